@@ -3,26 +3,107 @@
 #define TRUE 1
 #define MAX_CHARS 256
 #define BWT_OFFSET 4
+#define MAX_BWT_SIZE 0x7FFFFFFF   // rows and positions are int
 #define INDEX_LIMIT 512
-#define MAX_STRING_LEN 200
-
-#define RANK_INTERVAL 2048
+#define ARENA_BLOCK_SIZE 65536   // # bytes in each block of a result arena
+#define MIN_LINE_BUFFER 256      // first size of a line rebuild buffer
+#define NO_DUP -1               // dup_of of a result whose walk reached its line start
+
+#define RANK_INTERVAL 2048                    // longest checkpoint interval
+#define MIN_RANK_INTERVAL 64                  // shortest, one cache line
+#define IDX_WRITE_BLOCKS 512                  // count blocks per index write
+#define MIN_BYTES_PER_BUILD_THREAD (1 << 20)  // smaller runs are not worth a thread
 #define C_TABLE_OFFSET 1024
 
-// COMMAND LINE ARGUMENTS
-#define BWT_ARG 1
-#define INDEX_ARG 2
-#define QUERY_ARG 3
-#define UNBWT_ARG 4
-//TODO unbwt mode and search mode may have to be incremented by one/two
-// so we can use the out file for bwt
-#define UNBWT_MODE 5
-#define SEARCH_MODE 4
+// INDEX HEADER
+#define INDEX_MAGIC "BWTINDEX"
+#define INDEX_VERSION 2
+#define INDEX_HEADER_SIZE 64          // keeps the rank data 8 byte aligned
+#define FINGERPRINT_SPANS 64          // BWT spans hashed into the fingerprint
+#define FINGERPRINT_SPAN 64           // # bytes in each span
+
+// INDEX FORMATS
+#define IDX_CHECKPOINT 0      // count block every rank_interval bytes
+#define IDX_RANKDIR 1         // two-level rank directory
+#define IDX_RUNLENGTH 2       // runs of equal characters
+#define IDX_WAVELET 3         // wavelet matrix of bitvectors
+#define IDX_INTERLEAVED 4     // count blocks holding the BWT bytes they cover
+
+// CHECKPOINT INDEX
+#define CHECKPOINT_MAGIC "BWTCHKPT"
+
+// TWO-LEVEL RANK DIRECTORY
+#define RANK_DIR_MAGIC "BWTRKDIR"
+#define SUPERBLOCK_SIZE 65536 // block counts must fit in 16 bits
+#define MIN_BLOCK_SIZE 64     // one cache line
+#define MAX_BLOCK_SIZE 2048
+#define RD_ABSENT 0xFFFF      // code of a character not in the BWT
+
+// RUN-LENGTH INDEX
+#define RUN_LENGTH_MAGIC "BWTRUNLN"
+#define RUN_BLOCK 64          // runs per row of counts
+
+// WAVELET INDEX
+#define WAVELET_MAGIC "BWTWAVLT"
+#define WT_MAX_LEVELS 8       // bits in a character code
+#define WT_LINE_WORDS 8       // 64-bit words per line: a count, then bits
+#define WT_LINE_BITS ((WT_LINE_WORDS - 1) * 64)
+
+// INTERLEAVED INDEX
+#define INTERLEAVED_MAGIC "BWTILEAV"
+#define IL_LINE 64            // blocks are whole cache lines
+#define IL_MIN_PAYLOAD 32     // fewest BWT bytes in a block
+
+// SELECT SUPPORT
+#define SELECT_MAGIC "BWTSELCT"
+#define SELECT_SAMPLE_RATE 1024  // every 1024th occurrence of a char
+#define SELECT_SCAN_STEP 64      // bytes counted at a time in a select scan
+#define F_LOOKUP_BITS 16         // F column lookup has up to 2^16 buckets
+
+// SAMPLED SUFFIX ARRAY
+#define SA_MAGIC "BWTSASMP"
+#define SA_RANK_WORDS 8          // mark words between stored mark ranks
+
+// SAMPLED INVERSE SUFFIX ARRAY
+#define ISA_MAGIC "BWTISASM"
+#define UNBWT_TASK_SIZE (1 << 20)   // text bytes a parallel unbwt thread takes
+
+// UNBWT MEMORY
+#define UNBWT_MEM_BUDGET 512        // default memory cap of unbwt in MB
+#define MIN_UNBWT_BLOCK (1 << 16)   // smallest output block of a capped unbwt
+
 #define NEW_LINE_CHAR 10
 
 #define FIRST 0
 #define LAST 1
 
+// PARALLEL EXTRACTION
+#define MIN_MATCHES_PER_THREAD 256   // fewer are not worth a thread
+
+// LIMITED EXTRACTION
+#define NO_LINE 0xFFFFFFFFu          // empty slot of the seen lines set
+
+// QUERY STATISTICS
+#define NUM_PHASES 5
+#define PHASE_INTERVAL 0      // backward search for First and Last
+#define PHASE_BACKWARD 1      // walking lines back to their start
+#define PHASE_FORWARD 2       // walking lines on to their end
+#define PHASE_DEDUP 3         // dropping duplicate lines
+#define PHASE_OUTPUT 4        // handing lines to the caller
+// add n to a counter of the queries on this thread, if they are counted
+#define COUNT_STAT(field,n) do { \
+   if (__builtin_expect(counting != NULL,0)) counting->field += (n); \
+} while (0)
+// count a rank lookup that scanned that many BWT bytes and read idx index bytes
+#define COUNT_RANK(scanned,idx) do { \
+   if (__builtin_expect(counting != NULL,0)) { \
+      counting->rank_calls++; \
+      counting->bwt_bytes += (scanned); \
+      counting->idx_bytes += (idx); \
+      counting->blocks += ((idx) > 0); \
+   } \
+} while (0)
+
 /*********************************
  **        TYPE DEFINES         **
  *********************************/
@@ -33,16 +114,216 @@
 typedef struct _result_object *result;
 struct _result_object {
    unsigned int id;        //identify the line (use the last char or '\n')
-   char *b_string;  //backwards search results string
-   char *f_string;   //forwards search string
-   short int b_length;     //length of backwards result string
-   short int f_length;  //length of forward result string
+   int dup_of;             //match row the backwards walk ran into, or NO_DUP
+   char *b_string;  //line up to the match, in text order
+   char *f_string;   //line from the match on
+   unsigned int b_length;     //length of backwards result string
+   unsigned int f_length;  //length of forward result string
    result next;            //the next result;  
    
 } result_object;
 
 /*
-   Symbol table used to hold C array and other statitistics
+   One block of an arena, handed out front to back
+*/
+typedef struct _arena_block *arena_block;
+struct _arena_block {
+   arena_block next;       // the block filled before this one
+   size_t size;            // # bytes in data
+   size_t used;            // # bytes handed out
+   char data[];
+} arena_block_object;
+
+/*
+   Bump allocator holding the results of one query, lines included.
+   Nothing in it is freed on its own: free_arena() gives back every
+   block at once.
+*/
+typedef struct _arena_object *arena;
+struct _arena_object {
+   arena_block blocks;     // newest block first
+} arena_object;
+
+/*
+   Read only memory mapping of a whole file
+*/
+typedef struct _mapped_file *mapping;
+struct _mapped_file {
+   unsigned char *base;    // start of mapping (NULL if the file is empty)
+   size_t size;            // # bytes mapped
+} mapped_file;
+
+/*
+   Header at the start of every index file. Everything needed to tell
+   whether the index belongs to a BWT and how to read it, so a stale or
+   foreign index is caught without reading more than a few KB.
+   Offsets are from the start of the index file:
+      [header][rank data][optional sections][C[] table]
+*/
+typedef struct _index_header *index_info;
+struct _index_header {
+   char magic[8];                   // INDEX_MAGIC
+   unsigned int version;            // INDEX_VERSION
+   unsigned int format;             // IDX_*
+   unsigned int rank_interval;      // # BWT bytes per count block
+   unsigned int bwt_size;           // # bytes in the BWT (without header)
+   unsigned int last;               // row of the end of the BWT text
+   unsigned int rank_offset;        // start of the rank data
+   unsigned int sections_offset;    // start of the optional sections
+   unsigned int ctable_offset;      // start of the C[] table
+   uint64_t fingerprint;            // bwt_fingerprint() of the BWT
+   unsigned int reserved[4];        // zero, pads to INDEX_HEADER_SIZE
+} index_header;
+
+/*
+   Header of a checkpoint index (IDX_CHECKPOINT). Followed, at
+   blocks_offset from the start of this header, by one block every
+   rank_interval BWT bytes holding the count of each character up to
+   its end. Only characters that occur in the BWT get a column.
+*/
+typedef struct _checkpoint_header *checkpoint;
+struct _checkpoint_header {
+   char magic[8];                   // CHECKPOINT_MAGIC
+   unsigned int sigma;              // # distinct characters in the BWT
+   unsigned int blocks_offset;
+   unsigned short code[MAX_CHARS];  // column of each character or RD_ABSENT
+} checkpoint_header;
+
+/*
+   Header of a two-level rank directory index (IDX_RANKDIR).
+   Followed by the block counts, the superblock counts and the C[] table.
+   Superblocks hold 64-bit counts of each character before the superblock,
+   blocks hold 16-bit counts from the start of their superblock.
+   Only characters that occur in the BWT get a column.
+*/
+typedef struct _rank_dir_header *rank_dir;
+struct _rank_dir_header {
+   char magic[8];                   // RANK_DIR_MAGIC
+   unsigned int superblock_size;    // # BWT bytes per superblock
+   unsigned int block_size;         // # BWT bytes per block
+   unsigned int sigma;              // # distinct characters in the BWT
+   unsigned int num_superblocks;    // # superblock rows
+   unsigned int num_blocks;         // # block rows
+   unsigned int super_offset;       // byte offset of the superblock rows
+   unsigned short code[MAX_CHARS];  // column of each character or RD_ABSENT
+} rank_dir_header;
+
+/*
+   Header of a run-length index (IDX_RUNLENGTH). The BWT is stored as 
+   its runs of equal characters, so the index grows with the # runs 
+   rather than the text and queries never read the BWT file. Followed
+   by, at their offsets from the start of this header:
+      starts:  BWT position of each run, then bwt_size
+      counts:  # of each character before every RUN_BLOCK'th run
+      lookup:  run holding BWT position k << lookup_shift, for every k
+      heads:   character of each run
+   Only characters that occur in the BWT get a column of counts.
+*/
+typedef struct _run_length_header *run_length;
+struct _run_length_header {
+   char magic[8];                   // RUN_LENGTH_MAGIC
+   unsigned int num_runs;           // # runs in the BWT
+   unsigned int sigma;              // # distinct characters in the BWT
+   unsigned int num_blocks;         // # rows of counts
+   unsigned int lookup_shift;       // log2 of the BWT bytes per lookup entry
+   unsigned int num_lookup;         // # lookup entries
+   unsigned int starts_offset;
+   unsigned int counts_offset;
+   unsigned int lookup_offset;
+   unsigned int heads_offset;
+   unsigned short code[MAX_CHARS];  // column of each character or RD_ABSENT
+} run_length_header;
+
+/*
+   Header of a wavelet index (IDX_WAVELET). The BWT characters are given
+   dense codes of num_levels bits and stored as a wavelet matrix: level l
+   holds bit l (from the top) of the code of every character, in the
+   order level l - 1 leaves them, its zeros first and then its ones.
+   Rank and access take one bitvector rank per level, with no BWT scan,
+   and queries never read the BWT file. Followed, at lines_offset from
+   the start of this header, by num_lines cache lines for each level: 
+   the # ones before the line, then WT_LINE_BITS bits of the level, so 
+   a rank reads a single line.
+*/
+typedef struct _wavelet_header *wavelet;
+struct _wavelet_header {
+   char magic[8];                   // WAVELET_MAGIC
+   unsigned int sigma;              // # distinct characters in the BWT
+   unsigned int num_levels;         // # bits in a code
+   unsigned int num_lines;          // # lines in a level
+   unsigned int lines_offset;
+   unsigned int zeros[WT_MAX_LEVELS];  // # zeros in each level
+   unsigned int start[MAX_CHARS];      // where each code starts below the last level
+   unsigned short code[MAX_CHARS];  // code of each character or RD_ABSENT
+   unsigned char symbol[MAX_CHARS]; // character of each code
+} wavelet_header;
+
+/*
+   Header of an interleaved index (IDX_INTERLEAVED), which holds the BWT
+   itself. Block k, at blocks_offset + k * block_size from the start of
+   this header, is the count of each character before BWT position 
+   k * payload, then the payload BWT bytes from there on. A rank reads 
+   one block, its count and the bytes after it together, and queries
+   never read the BWT file. Only characters that occur in the BWT get 
+   a count.
+*/
+typedef struct _interleaved_header *interleaved;
+struct _interleaved_header {
+   char magic[8];                   // INTERLEAVED_MAGIC
+   unsigned int sigma;              // # distinct characters in the BWT
+   unsigned int block_size;         // # bytes per block, whole IL_LINEs
+   unsigned int payload;            // # BWT bytes per block, a power of two
+   unsigned int payload_shift;      // log2 of payload
+   unsigned int num_blocks;         // # blocks
+   unsigned int blocks_offset;      // IL_LINE aligned in the file
+   unsigned short code[MAX_CHARS];  // column of each character or RD_ABSENT
+} interleaved_header;
+
+/*
+   Header of the sampled select positions, stored just before the C[] table.
+   Followed by the positions of occurrence rate, 2 * rate, ... of each
+   character, character by character.
+*/
+typedef struct _select_header *select_samples;
+struct _select_header {
+   char magic[8];                      // SELECT_MAGIC
+   unsigned int rate;                  // # occurrences between samples
+   unsigned int num_samples;           // # positions that follow
+   unsigned int start[MAX_CHARS + 1];  // first sample of each character
+} select_header;
+
+/*
+   Header of the sampled suffix array, stored just before the C[] table.
+   Followed by a bit per BWT row marking the rows whose text offset is a
+   multiple of rate (64-bit words), the # marks before every SA_RANK_WORDS
+   words, and the text offsets of the marked rows in row order.
+*/
+typedef struct _sa_header *sa_samples;
+struct _sa_header {
+   char magic[8];                // SA_MAGIC
+   unsigned int rate;            // # text positions between samples
+   unsigned int num_samples;     // # marked rows
+   unsigned int num_words;       // # 64-bit words of marks
+   unsigned int num_ranks;       // # stored mark ranks
+} sa_header;
+
+/*
+   Header of the sampled inverse suffix array, stored just before the
+   C[] table. Followed by the BWT row of text offsets 0, rate, 2 * rate, ...
+   so every rate sized chunk of the text can be decoded on its own,
+   starting from the row of the chunk after it.
+*/
+typedef struct _isa_header *isa_samples;
+struct _isa_header {
+   char magic[8];                // ISA_MAGIC
+   unsigned int rate;            // # text positions between samples
+   unsigned int num_samples;     // # rows that follow
+} isa_header;
+
+/*
+   Symbol table used to hold C array and other statitistics.
+   After load_index() it is only read, so any number of threads may
+   search through it at once.
 */
 typedef struct _symbol_table *table;
 struct _symbol_table {
@@ -52,10 +333,121 @@ struct _symbol_table {
    unsigned int bwt_size;        // # bytes in the file (- 1st four bytes)
    unsigned int last;            // Position of the last character in bwt
    unsigned int idx_size;        // # bytes in index
-   
+   index_info info;              // mapped index header
+   unsigned int num_blocks;      // # checkpoint blocks in index
+   int idx_format;               // layout of the index file (IDX_*)
+   const unsigned short *code;   // column of each character or RD_ABSENT
+   checkpoint ck;                // mapped checkpoint header
+   const unsigned int *ck_blocks;   // mapped checkpoint blocks
+   unsigned int ck_shift;        // log2 of the checkpoint interval
+   rank_dir rd;                  // mapped rank directory header
+   const uint64_t *rd_super;     // mapped superblock counts
+   const uint16_t *rd_blocks;    // mapped block counts
+   run_length rl;                // mapped run-length header
+   const unsigned int *rl_starts;   // mapped run starts
+   const unsigned int *rl_counts;   // mapped counts before each block of runs
+   const unsigned int *rl_lookup;   // mapped run of every lookup position
+   const unsigned char *rl_heads;   // mapped run characters
+   wavelet wt;                   // mapped wavelet header
+   const uint64_t *wt_lines;     // mapped lines of every level
+   unsigned int wt_load;         // tells this mapping apart from earlier ones
+   interleaved il;               // mapped interleaved header
+   const unsigned char *il_blocks;  // mapped interleaved blocks
+   select_samples sel;           // mapped select samples (NULL if none)
+   const unsigned int *sel_pos;  // mapped select sample positions
+   sa_samples sa;                // mapped suffix array samples (NULL if none)
+   const uint64_t *sa_marks;     // mapped marks of the sampled rows
+   const unsigned int *sa_ranks; // mapped # marks before each group of words
+   const unsigned int *sa_pos;   // mapped text offsets of the sampled rows
+   isa_samples isa;              // mapped inverse suffix array samples
+   const unsigned int *isa_rows; // mapped rows of the sampled text offsets
+   unsigned char *f_lookup;      // F column character at each bucket start
+   unsigned int f_shift;         // log2 of the F column bucket size
+   const unsigned char *bwt_data;   // mapped BWT payload (after BWT_OFFSET)
+   const unsigned int *idx_data;    // mapped index file
+   mapping bwt_map;              // mapping of the whole BWT file
+   mapping idx_map;              // mapping of the whole index file
    
 } symbol_table;
 
+/*
+   Counters and phase times of the queries a thread runs while it counts
+   (see counting). Bytes are those the rank and select scans read from
+   the BWT, and the index entries they read.
+*/
+typedef struct _query_stats *query_stats;
+struct _query_stats {
+   uint64_t rank_calls;          // occ() calls
+   uint64_t select_calls;        // pos_of_rank_c_in_bwt() calls
+   uint64_t lf_steps;            // steps back one text position
+   uint64_t bwt_bytes;           // BWT bytes scanned
+   uint64_t idx_bytes;           // index bytes read
+   uint64_t blocks;              // checkpoint blocks or rank directory rows read
+   double phase_time[NUM_PHASES];   // seconds in each PHASE_*
+} query_stats_object;
+
+/*
+   One slice of the matches rebuilt by an extraction thread
+*/
+typedef struct _extract_job *extract_job;
+struct _extract_job {
+   table st;
+   int fnl[2];             // First and Last of the slice
+   int range[2];           // First and Last of all the matches
+   arena results;          // holds the slice's results
+   result head;            // the slice's results, in row order
+   int counted;            // count the slice into stats
+   struct _query_stats stats;
+} extract_job_object;
+
+/*
+   One run of whole RANK_INTERVAL blocks counted by an index build thread
+*/
+typedef struct _count_job *count_job;
+struct _count_job {
+   const unsigned char *data;    // the BWT payload
+   unsigned int start;           // first byte of the run
+   unsigned int end;             // one past the last byte of the run
+   unsigned int count[MAX_CHARS];
+   int write;                    // FALSE: count the run, TRUE: write its blocks
+   unsigned int interval;        // # BWT bytes per count block
+   unsigned int sigma;           // # columns in a count block
+   const unsigned char *symbols; // character of each column
+   int fd;                       // index file
+   off_t offset;                 // where the count blocks start in it
+   int failed;                   // a write failed
+} count_job_object;
+
+/*
+   Rows of the text strings an approximate search reached with the whole
+   pattern spent, and the errors it took to get there
+*/
+typedef struct _approx_hit *approx_hit;
+struct _approx_hit {
+   int fnl[2];             // First and Last
+   int errors;
+} approx_hit_object;
+
+/*
+   One approximate search: the pattern is matched backwards, branching on
+   every character the BWT holds, while the errors stay within bounds
+*/
+typedef struct _approx_search *approx_search;
+struct _approx_search {
+   table st;
+   const unsigned char *query;
+   int length;                   // |query|
+   int max_errors;
+   int edits;                    // insertions and deletions are errors too
+   int *bound;                   // fewest errors query[0 .. i) needs
+   int *columns;                 // edit distances of each text string depth
+   unsigned char symbols[MAX_CHARS];   // characters a match may hold
+   int sigma;                    // # symbols
+   approx_hit hits;
+   int num_hits;
+   int hits_cap;
+} approx_search_object;
+
 
 /*********************************
  **      FUNCTION PROTOTYPES    **
@@ -63,30 +455,134 @@ struct _symbol_table {
  
 /* STRUCTS */
 static table new_symbol_table ();
-result new_result ();
+result new_result (arena a);
+
+/* RESULT ARENAS */
+static arena new_arena (void);
+static void *arena_alloc (arena a, size_t size);
+static char *arena_copy (arena a, const char *data, size_t len);
+static void merge_arena (arena into, arena from);
+static void free_arena (arena a);
+static char *grow_line (char *buf, size_t *cap, int at_end);
+
+/* MEMORY MAPPED ACCESS */
+static mapping map_file (FILE *f);
+static void unmap_file (mapping m);
+static int map_bwt_and_idx (table st, FILE *bwt, FILE *idx);
+static void unmap_bwt_and_idx (table st);
+static int load_index (table st, FILE *bwt, FILE *idx);
+static void unload_index (table st);
 
 /* SEARCH RELATED FUNCTIONS */
-static void backwards_search (char *query,table st, FILE *bwt, FILE *idx);
-static void  get_first_and_last (char *query,table st, FILE *bwt, FILE *idx, int *fnl);
-result backwards_results (int *fnl,table st, FILE *bwt, FILE *idx);
-void forward_results(int *fnl,result head,table st, FILE *bwt, FILE *idx);
-int pos_of_rank_c_in_bwt (int c,int rank,table st, FILE *bwt, FILE *idx);
-void search_for_duplicate_lines (result head);
-void sort_b_strings(result head);
-void free_results(result head);
+typedef int (*line_callback) (const char *line, unsigned int length, void *arg);
+static int search_lines (char *query,table st, int threads, int max_lines, line_callback fn, void *arg);
+typedef int (*approx_line_callback) (const char *line, unsigned int length, int errors, void *arg);
+static int search_approx_lines (char *query,table st, int max_errors, int edits, int threads, int max_lines, approx_line_callback fn, void *arg);
+static void approx_bounds (approx_search s);
+static void approx_step (approx_search s, int i, int first, int last, int errors);
+static void approx_edit_step (approx_search s, int depth, int first, int last);
+static void add_approx_hit (approx_search s, int first, int last, int errors);
+static int approx_segments (approx_search s, approx_hit *segments);
+static int compare_hits (const void *a, const void *b);
+static int locate_matches (char *query,table st, unsigned int **offsets);
+static int count_matches (char *query,table st);
+static unsigned int extract (table st, unsigned int offset, unsigned int length, char *out);
+static unsigned int locate (table st, unsigned int row);
+static unsigned int lf (table st, unsigned int row);
+static void  get_first_and_last (char *query,table st, int *fnl);
+static void narrow_interval (int c, table st, int *fnl);
+result backwards_results (int *fnl,int *range,table st,arena a);
+static result extract_results (int *fnl,table st, int threads, arena a);
+static result first_lines (int *fnl,table st, int max_lines, arena a);
+static void *run_extract_job (void *arg);
+void forward_results(int *fnl,result head,table st,arena a);
+int pos_of_rank_c_in_bwt (int c,int rank,table st);
+static int select_scan (int c, unsigned int rank, table st, unsigned int from, unsigned int count);
+static unsigned int num_boundaries (table st);
+static unsigned int boundary_interval (table st);
+static unsigned int boundary_rank (table st, unsigned int boundary, int c);
+static void build_f_lookup (table st);
+static int f_column_char (table st, unsigned int pos);
+result drop_duplicate_lines (result head, int *fnl);
 int count_results (result head);
 /* UNIVERSAL */
 static int get_last_occurence (unsigned int *ctable, int c);
-unsigned int occ (int c, int position,FILE *bwt, FILE *idx);
-int occ_func(int character,int limit,FILE *bwt);
-static unsigned int get_last_char_pos (FILE *bwt);
-static unsigned int get_bwt_size (FILE *bwt);
-static unsigned int get_idx_size (FILE *idx);
-int get_last_char (FILE *bwt,int position);
-static void c_table_from_idx (table st, FILE *idx);
+unsigned int occ (int c, int position,table st);
+int occ_func(int character,int limit,const unsigned char *bwt);
+int occ_func_pos(int character,int position,const unsigned char *bwt,int from);
+static unsigned int get_last_char_pos (table st);
+static unsigned int get_bwt_size (table st);
+static int bwt_size_fits (size_t file_size);
+static unsigned int get_idx_size (table st);
+int get_last_char (table st,int position);
+static int bwt_char (table st, unsigned int pos);
+static void c_table_from_idx (table st);
+static uint64_t bwt_fingerprint (const unsigned char *bwt, unsigned int size, unsigned int last);
+static int index_matches (const unsigned char *idx, size_t idx_size, const unsigned char *bwt, size_t bwt_size);
+static int index_is_current (FILE *bwt, FILE *idx);
+static void write_index_header (FILE *idx, const unsigned char *bwt_file, unsigned int bwt_size, unsigned int format, unsigned int rank_interval, unsigned int sections_offset, unsigned int ctable_offset);
+static int finish_index (FILE *idx, const unsigned char *bwt_file, unsigned int bwt_size, unsigned int *freq, unsigned int format, unsigned int rank_interval, unsigned int sections_offset);
+
+/* BYTE COUNTING KERNELS */
+typedef unsigned int (*count_kernel) (const unsigned char *data, unsigned int len, int c);
+static unsigned int count_bytes_scalar (const unsigned char *data, unsigned int len, int c);
+static void select_count_kernel (void);
+static count_kernel count_bytes = count_bytes_scalar;
+
+/* QUERY STATISTICS */
+static __thread query_stats counting = NULL;    // this thread's counters, NULL: off
+static double stats_clock (void);
+static void add_phase_time (int phase, double start);
+static void merge_query_stats (query_stats into, query_stats from, int parallel);
+
+/* TWO-LEVEL RANK DIRECTORY */
+static unsigned int rank_dir_boundary (table st, unsigned int block, int code);
+static unsigned int rank_dir_occ (int c, unsigned int position, table st);
+
+/* RUN-LENGTH INDEX */
+static unsigned int run_of_position (table st, unsigned int pos);
+static unsigned int run_length_occ (int c, unsigned int position, table st);
+static int run_length_select (int c, unsigned int rank, table st);
+
+/* WAVELET INDEX */
+// the last wavelet_access() on this thread and the rank of its character
+// there, which answers the occ() of an LF step without a second descent
+static __thread struct {
+   unsigned int load;            // wt_load of the table it was read from
+   unsigned int pos;
+   int c;
+   unsigned int rank;
+} wt_last = {0,0,0,0};
+static unsigned int wt_loads = 0;   // # wavelet indexes mapped so far
+
+static unsigned int wt_rank1 (table st, unsigned int level, unsigned int pos);
+static unsigned int wt_select (table st, unsigned int level, int bit, unsigned int rank);
+static unsigned int wavelet_occ (int c, unsigned int position, table st);
+static int wavelet_access (table st, unsigned int pos);
+static int wavelet_select (int c, unsigned int rank, table st);
+
+/* INTERLEAVED INDEX */
+static const unsigned char *interleaved_block (table st, unsigned int block);
+static unsigned int interleaved_occ (int c, unsigned int position, table st);
 
 /* INDEX CREATION FUNCTIONS */
-static void create_idx (char *idx_file_loc, FILE *bwt);
+static int create_idx (const char *idx_file_loc, FILE *bwt, int threads);
+static void run_count_jobs (count_job jobs, pthread_t *workers, int threads);
+static void *run_count_job (void *arg);
+static int create_rank_dir_idx (const char *idx_file_loc, FILE *bwt);
+static int create_run_length_idx (const char *idx_file_loc, FILE *bwt);
+static int create_wavelet_idx (const char *idx_file_loc, FILE *bwt);
+static int create_interleaved_idx (const char *idx_file_loc, FILE *bwt);
+static unsigned int rank_dir_block_size (unsigned int bwt_size, unsigned int sigma);
+static unsigned int checkpoint_interval (unsigned int sigma);
+static void write_select_samples (FILE *idx, const unsigned char *data, unsigned int size, unsigned int *freq);
+static void find_sections (table st, unsigned int offset, unsigned int end);
+static int section_fits (uint64_t offset, uint64_t size, uint64_t end);
+static int codes_fit (const unsigned short *code, unsigned int sigma);
+static int rank_data_fits (table st);
+static int add_samples (const char *idx_file_loc, table st, unsigned int sa_rate, unsigned int isa_rate);
+static void pad_to_section (FILE *idx);
+static int compare_uint (const void *a, const void *b);
 static unsigned int * create_c_table (unsigned int *freq);
 
 
@@ -95,20 +591,18 @@ static unsigned int * create_c_table (unsigned int *freq);
  **        DEBUG PROTOTYPES     **
  *********************************/
 void print_c_table (unsigned int *ctable);
-void print_stats (table st);
 
  /**********************************
  **      FUNCTION DEFINITIONS     **
  **********************************/
 
 
-result new_result () {
-   result r = malloc(sizeof(result_object));   
+result new_result (arena a) {
+   result r = arena_alloc(a,sizeof(result_object));
    r->id = 0;
-   r->b_string = malloc(sizeof(char) * MAX_STRING_LEN);   
-   memset(r->b_string,0,sizeof(char) * MAX_STRING_LEN);     // set everything to 0
-   r->f_string = malloc(sizeof(char) * MAX_STRING_LEN);  
-   memset(r->f_string,0,sizeof(char) * MAX_STRING_LEN);     // set everything to 0
+   r->dup_of = NO_DUP;
+   r->b_string = NULL;
+   r->f_string = NULL;
    r->b_length = 0;
    r->f_length = 0;
    r->next = NULL;
@@ -116,178 +610,1822 @@ result new_result () {
 }
 
 
-static void create_idx (char *idx_file_loc, FILE *bwt) {
-   int c;
-   unsigned int count[MAX_CHARS] = {0}; //will be used as rank
-   unsigned int total_count = 0;        //store the number of characters seen
-//   unsigned int rank[MAX_CHARS] = {0};
+static arena new_arena (void) {
+   arena a = malloc(sizeof(arena_object));
+   a->blocks = NULL;
+   return a;
+}
+
+/*
+   Hand out size bytes, 8 byte aligned. A request larger than a block
+   gets a block of its own.
+*/
+static void *arena_alloc (arena a, size_t size) {
+   size = (size + 7) & ~(size_t) 7;
+   arena_block b = a->blocks;
+   if (b == NULL || b->size - b->used < size) {
+      size_t block_size = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+      b = malloc(sizeof(arena_block_object) + block_size);
+      if (b == NULL) abort();
+      b->size = block_size;
+      b->used = 0;
+      b->next = a->blocks;
+      a->blocks = b;
+   }
+   void *p = b->data + b->used;
+   b->used += size;
+   return p;
+}
+
+static char *arena_copy (arena a, const char *data, size_t len) {
+   if (len == 0) return NULL;
+   char *p = arena_alloc(a,len);
+   memcpy(p,data,len);
+   return p;
+}
+
+/*
+   Move every block of from into into and free from.
+*/
+static void merge_arena (arena into, arena from) {
+   arena_block b = from->blocks;
+   if (b != NULL) {
+      while (b->next != NULL) b = b->next;
+      b->next = into->blocks;
+      into->blocks = from->blocks;
+   }
+   free(from);
+}
+
+static void free_arena (arena a) {
+   arena_block b = a->blocks;
+   while (b != NULL) {
+      arena_block next = b->next;
+      free(b);
+      b = next;
+   }
+   free(a);
+}
+
+/*
+   Double the size of a line buffer. A backwards walk fills its buffer
+   from the end (at_end), so what it has so far moves to the end of the
+   new buffer and the line stays in text order.
+*/
+static char *grow_line (char *buf, size_t *cap, int at_end) {
+   size_t old = *cap;
+   *cap = (old == 0) ? MIN_LINE_BUFFER : old * 2;
+   char *grown;
+   if (!at_end) {
+      grown = realloc(buf,*cap);
+      if (grown == NULL) abort();
+      return grown;
+   }
+   grown = malloc(*cap);
+   if (grown == NULL) abort();
+   if (old > 0) memcpy(grown + *cap - old,buf,old);
+   free(buf);
+   return grown;
+}
+
+
+/*
+   Create the checkpoint index (IDX_CHECKPOINT): the counts of every
+   char in the BWT up to the end of each block, then the select 
+   samples and the C[] table. The BWT is cut into runs of whole blocks,
+   one per thread. Every thread counts its run, the per run totals are 
+   summed into starting counts and give the alphabet, then every thread
+   writes the blocks of its run at their offset. The file is the same 
+   for any thread count.
+   @return: FALSE if the BWT cannot be read or the index written
+*/
+static int create_idx (const char *idx_file_loc, FILE *bwt, int threads) {
+   mapping m = map_file(bwt);
+   if (m == NULL) return FALSE;
+   if (!bwt_size_fits(m->size)) {
+      unmap_file(m);
+      return FALSE;
+   }
+   const unsigned char *data = m->base + BWT_OFFSET;
+   unsigned int size = m->size - BWT_OFFSET;
+   unsigned int num_blocks = size / RANK_INTERVAL;
+   unsigned int count[MAX_CHARS] = {0};
+   unsigned char symbols[MAX_CHARS];
+   int i, c;
 
    // Create new index file
    FILE *idx = fopen(idx_file_loc,"w+");
-   fseek(bwt,BWT_OFFSET,SEEK_SET);
-//   int debugCount = 0;
-   while ((c = fgetc(bwt)) != EOF) {
-      count[c]++;
-      total_count++;
-      /* 
-         for every RANK_INTERVAL characters (eg 2048 characters)
-         read in, write out the count array to the index file.
-         These will be used as starting points to calculate the
-         rank.
-         This should ensure that the index file does not exceed bwt_size / 2
-      */
-      if (total_count % RANK_INTERVAL == 0) {
-//         debugCount++;
-//         printf("total char count = %d, interval: %d\n",total_count++,debugCount);
-//         print_c_table(count);
-         fwrite (count,sizeof(int),MAX_CHARS,idx);
+   if (idx == NULL) {
+      unmap_file(m);
+      return FALSE;
+   }
+   if (threads > (int) (size / MIN_BYTES_PER_BUILD_THREAD)) threads = size / MIN_BYTES_PER_BUILD_THREAD;
+   if (threads < 1) threads = 1;
+   unsigned int run = (num_blocks + threads - 1) / threads;
+   if (run == 0) run = 1;
+
+   count_job jobs = calloc(threads,sizeof(count_job_object));
+   pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+   for (i = 0; i < threads; i++) {
+      jobs[i].data = data;
+      jobs[i].fd = fileno(idx);
+      jobs[i].start = (uint64_t) i * run * RANK_INTERVAL < size ? i * run * RANK_INTERVAL : size;
+      jobs[i].end = (uint64_t) (i + 1) * run * RANK_INTERVAL < size ? (i + 1) * run * RANK_INTERVAL : size;
+      if (i == threads - 1) jobs[i].end = size;
+   }
+
+   // First pass: count every run
+   run_count_jobs(jobs,workers,threads);
+
+   // Starting counts of each run, and the totals for the C[] table
+   for (i = 0; i < threads; i++) {
+      for (c = 0; c < MAX_CHARS; c++) {
+         unsigned int run_count = jobs[i].count[c];
+         jobs[i].count[c] = count[c];
+         count[c] += run_count;
+      }
+   }
+
+   // Only the characters in the BWT get a column
+   struct _checkpoint_header hdr;
+   memset(&hdr,0,sizeof(hdr));
+   memcpy(hdr.magic,CHECKPOINT_MAGIC,8);
+   for (c = 0; c < MAX_CHARS; c++) {
+      if (count[c] > 0) {
+         symbols[hdr.sigma] = c;
+         hdr.code[c] = hdr.sigma++;
+      }
+      else hdr.code[c] = RD_ABSENT;
+   }
+   hdr.blocks_offset = (sizeof(checkpoint_header) + 7) & ~7;
+   unsigned int interval = checkpoint_interval(hdr.sigma);
+   num_blocks = size / interval;
+   fseek(idx,INDEX_HEADER_SIZE,SEEK_SET);
+   fwrite(&hdr,sizeof(hdr),1,idx);
+   fflush(idx);
+   for (i = 0; i < threads; i++) {
+      jobs[i].offset = INDEX_HEADER_SIZE + hdr.blocks_offset;
+      jobs[i].interval = interval;
+      jobs[i].sigma = hdr.sigma;
+      jobs[i].symbols = symbols;
+      jobs[i].write = TRUE;
+   }
+
+   // Second pass: write the blocks of every run
+   run_count_jobs(jobs,workers,threads);
+   int failed = FALSE;
+   for (i = 0; i < threads; i++) {
+      if (jobs[i].failed) failed = TRUE;
+   }
+   free(jobs);
+   free(workers);
+   if (failed) {
+      unmap_file(m);
+      fclose(idx);
+      return FALSE;
+   }
+
+   // Sampled select positions go between the blocks and the C[] table
+   unsigned int sections_offset = (INDEX_HEADER_SIZE + hdr.blocks_offset + num_blocks * hdr.sigma * sizeof(int) + 7) & ~7;
+   fseek(idx,sections_offset,SEEK_SET);
+   write_select_samples(idx,data,size,count);
+   int written = finish_index(idx,m->base,size,count,IDX_CHECKPOINT,interval,sections_offset);
+   unmap_file(m);
+   return written;
+}
+
+/*
+   Run job on threads threads, or on this one if they cannot be started.
+*/
+static void run_count_jobs (count_job jobs, pthread_t *workers, int threads) {
+   int i;
+   int started = 0;
+   for (i = 0; i < threads; i++) {
+      if (pthread_create(&workers[i],NULL,run_count_job,&jobs[i]) != 0) break;
+      started++;
+   }
+   for (i = started; i < threads; i++) run_count_job(&jobs[i]);
+   for (i = 0; i < started; i++) pthread_join(workers[i],NULL);
+}
+
+/*
+   Count the chars of one run. On the write pass count starts at the
+   counts before the run and a count block of the characters with a
+   column is written at the end of every interval, IDX_WRITE_BLOCKS 
+   blocks at a time.
+*/
+static void *run_count_job (void *arg) {
+   count_job job = arg;
+   unsigned int *blocks = NULL;
+   unsigned int num_buffered = 0;
+   unsigned int sigma = job->sigma;
+   unsigned int pos, k;
+   if (!job->write) {
+      for (pos = job->start; pos < job->end; pos++) job->count[job->data[pos]]++;
+      return NULL;
+   }
+   // the interval is only chosen once the counting pass is done
+   unsigned int first_block = job->start / job->interval;
+   blocks = malloc(sizeof(int) * (sigma + 1) * IDX_WRITE_BLOCKS);
+   for (pos = job->start; pos < job->end; pos++) {
+      job->count[job->data[pos]]++;
+      if ((pos + 1) % job->interval == 0) {
+         unsigned int *block = blocks + num_buffered * sigma;
+         for (k = 0; k < sigma; k++) block[k] = job->count[job->symbols[k]];
+         num_buffered++;
+         if (num_buffered == IDX_WRITE_BLOCKS || pos + 1 == job->end) {
+            size_t len = sizeof(int) * sigma * num_buffered;
+            off_t offset = job->offset + (off_t) first_block * sigma * sizeof(int);
+            if (pwrite(job->fd,blocks,len,offset) != (ssize_t) len) job->failed = TRUE;
+            first_block += num_buffered;
+            num_buffered = 0;
+         }
+      }
+   }
+   if (num_buffered > 0) {
+      size_t len = sizeof(int) * sigma * num_buffered;
+      off_t offset = job->offset + (off_t) first_block * sigma * sizeof(int);
+      if (pwrite(job->fd,blocks,len,offset) != (ssize_t) len) job->failed = TRUE;
+   }
+   free(blocks);
+   return NULL;
+}
+
+/*
+   Pick the shortest checkpoint interval whose blocks take at most half
+   the BWT, as RANK_INTERVAL blocks of every character did: the fewer
+   characters a BWT has, the denser its checkpoints.
+   @params: sigma is the # distinct chars in the BWT
+   @return: # BWT bytes per block, a power of two
+*/
+static unsigned int checkpoint_interval (unsigned int sigma) {
+   unsigned int interval = MIN_RANK_INTERVAL;
+   while (interval < RANK_INTERVAL && interval < 2 * sigma * sizeof(int)) interval *= 2;
+   return interval;
+}
+
+/*
+   Pick the smallest block size that keeps the rank directory under 
+   half the size of the BWT, so the final scan of a rank is as short
+   as the alphabet allows.
+   @params: bwt_size is the # bytes in the BWT, sigma the # distinct chars
+   @return: # BWT bytes per block
+*/
+static unsigned int rank_dir_block_size (unsigned int bwt_size, unsigned int sigma) {
+   unsigned int block_size;
+   uint64_t super_bytes = ((uint64_t) bwt_size / SUPERBLOCK_SIZE + 1) * sigma * 8;
+   uint64_t select_bytes = sizeof(select_header) + (bwt_size / SELECT_SAMPLE_RATE) * sizeof(int);
+   for (block_size = MIN_BLOCK_SIZE; block_size < MAX_BLOCK_SIZE; block_size *= 2) {
+      uint64_t block_bytes = ((uint64_t) bwt_size / block_size + 1) * sigma * 2;
+      uint64_t total = INDEX_HEADER_SIZE + sizeof(rank_dir_header) + block_bytes + super_bytes 
+                     + select_bytes + C_TABLE_OFFSET;
+      if (total < bwt_size / 2) break;
+   }
+   return block_size;
+}
+
+/*
+   Create a two-level rank directory index (IDX_RANKDIR).
+   The first pass finds the alphabet, the second streams out the block
+   counts while collecting the (small) superblock counts in memory.
+   @return: FALSE if the BWT cannot be read or the index written
+*/
+static int create_rank_dir_idx (const char *idx_file_loc, FILE *bwt) {
+   mapping m = map_file(bwt);
+   if (m == NULL) return FALSE;
+   if (!bwt_size_fits(m->size)) {
+      unmap_file(m);
+      return FALSE;
+   }
+   const unsigned char *data = m->base + BWT_OFFSET;
+   unsigned int size = m->size - BWT_OFFSET;
+   unsigned int freq[MAX_CHARS] = {0};
+   unsigned int count[MAX_CHARS] = {0};
+   unsigned int sb_base[MAX_CHARS] = {0};
+   unsigned int i, c, b;
+
+   // First pass: alphabet
+   for (i = 0; i < size; i++) freq[data[i]]++;
+   struct _rank_dir_header hdr;
+   memset(&hdr,0,sizeof(hdr));
+   memcpy(hdr.magic,RANK_DIR_MAGIC,8);
+   for (c = 0; c < MAX_CHARS; c++) {
+      hdr.code[c] = (freq[c] > 0) ? hdr.sigma++ : RD_ABSENT;
+   }
+   unsigned int sigma = hdr.sigma;
+   hdr.superblock_size = SUPERBLOCK_SIZE;
+   hdr.block_size = rank_dir_block_size(size,sigma);
+   hdr.num_superblocks = size / SUPERBLOCK_SIZE + 1;
+   hdr.num_blocks = size / hdr.block_size + 1;
+   hdr.super_offset = sizeof(rank_dir_header) + hdr.num_blocks * sigma * sizeof(uint16_t);
+   // keep the 64-bit rows aligned
+   hdr.super_offset = (hdr.super_offset + 7) & ~7u;
+
+   FILE *idx = fopen(idx_file_loc,"w+");
+   if (idx == NULL) {
+      unmap_file(m);
+      return FALSE;
+   }
+   fseek(idx,INDEX_HEADER_SIZE,SEEK_SET);
+   fwrite(&hdr,sizeof(hdr),1,idx);
+
+   // Second pass: block rows, remembering the superblock rows
+   uint64_t *super = malloc(sizeof(uint64_t) * hdr.num_superblocks * (sigma + 1));
+   uint16_t *row = malloc(sizeof(uint16_t) * (sigma + 1));
+   unsigned int blocks_per_super = SUPERBLOCK_SIZE / hdr.block_size;
+   for (b = 0; b < hdr.num_blocks; b++) {
+      unsigned int start = b * hdr.block_size;
+      unsigned int end = start + hdr.block_size;
+      if (end > size) end = size;
+      if (b % blocks_per_super == 0) {
+         uint64_t *sb = super + (b / blocks_per_super) * sigma;
+         for (c = 0; c < MAX_CHARS; c++) {
+            if (hdr.code[c] == RD_ABSENT) continue;
+            sb[hdr.code[c]] = count[c];
+            sb_base[c] = count[c];
+         }
+      }
+      for (c = 0; c < MAX_CHARS; c++) {
+         if (hdr.code[c] != RD_ABSENT) row[hdr.code[c]] = count[c] - sb_base[c];
+      }
+      fwrite(row,sizeof(uint16_t),sigma,idx);
+      for (i = start; i < end; i++) count[data[i]]++;
+   }
+   // pad up to the superblock rows
+   long pad = INDEX_HEADER_SIZE + hdr.super_offset - ftell(idx);
+   while (pad-- > 0) fputc(0,idx);
+   fwrite(super,sizeof(uint64_t),hdr.num_superblocks * sigma,idx);
+   unsigned int sections_offset = ftell(idx);
+   write_select_samples(idx,data,size,freq);
+   int written = finish_index(idx,m->base,size,freq,IDX_RANKDIR,hdr.block_size,sections_offset);
+
+   free(super);
+   free(row);
+   unmap_file(m);
+   return written;
+}
+
+/*
+   Create a run-length index (IDX_RUNLENGTH). The first pass counts the
+   runs, the second fills in the run arrays, which are all that is kept
+   in memory: the index of a BWT with few runs is small to build too.
+   @return: FALSE if the BWT cannot be read or the index written
+*/
+static int create_run_length_idx (const char *idx_file_loc, FILE *bwt) {
+   mapping m = map_file(bwt);
+   if (m == NULL) return FALSE;
+   if (!bwt_size_fits(m->size)) {
+      unmap_file(m);
+      return FALSE;
+   }
+   const unsigned char *data = m->base + BWT_OFFSET;
+   unsigned int size = m->size - BWT_OFFSET;
+   unsigned int freq[MAX_CHARS] = {0};
+   unsigned int count[MAX_CHARS] = {0};
+   unsigned int i, c, r;
+
+   // First pass: alphabet and # runs
+   struct _run_length_header hdr;
+   memset(&hdr,0,sizeof(hdr));
+   memcpy(hdr.magic,RUN_LENGTH_MAGIC,8);
+   for (i = 0; i < size; i++) {
+      freq[data[i]]++;
+      if (i == 0 || data[i] != data[i - 1]) hdr.num_runs++;
+   }
+   for (c = 0; c < MAX_CHARS; c++) {
+      hdr.code[c] = (freq[c] > 0) ? hdr.sigma++ : RD_ABSENT;
+   }
+   unsigned int sigma = hdr.sigma;
+   hdr.num_blocks = hdr.num_runs / RUN_BLOCK + 1;
+   // about one lookup entry per run
+   while ((size >> hdr.lookup_shift) + 1 > hdr.num_runs && (size >> hdr.lookup_shift) > 0) hdr.lookup_shift++;
+   hdr.num_lookup = (size >> hdr.lookup_shift) + 1;
+   hdr.starts_offset = sizeof(run_length_header);
+   hdr.counts_offset = hdr.starts_offset + (hdr.num_runs + 1) * sizeof(int);
+   hdr.lookup_offset = hdr.counts_offset + hdr.num_blocks * sigma * sizeof(int);
+   hdr.heads_offset = hdr.lookup_offset + hdr.num_lookup * sizeof(int);
+
+   // Second pass: the runs
+   unsigned int *starts = malloc(sizeof(int) * (hdr.num_runs + 1));
+   unsigned int *counts = malloc(sizeof(int) * (hdr.num_blocks * sigma + 1));
+   unsigned int *lookup = malloc(sizeof(int) * hdr.num_lookup);
+   unsigned char *heads = malloc(hdr.num_runs + 1);
+   r = 0;
+   for (i = 0; i < size; i++) {
+      if (i > 0 && data[i] == data[i - 1]) continue;
+      if (r > 0) count[heads[r - 1]] += i - starts[r - 1];
+      if (r % RUN_BLOCK == 0) {
+         for (c = 0; c < MAX_CHARS; c++) {
+            if (hdr.code[c] != RD_ABSENT) counts[(r / RUN_BLOCK) * sigma + hdr.code[c]] = count[c];
+         }
+      }
+      starts[r] = i;
+      heads[r] = data[i];
+      r++;
+   }
+   starts[hdr.num_runs] = size;
+   // a last block row of its own when the runs fill every block
+   if (hdr.num_runs % RUN_BLOCK == 0) {
+      if (hdr.num_runs > 0) count[heads[hdr.num_runs - 1]] += size - starts[hdr.num_runs - 1];
+      for (c = 0; c < MAX_CHARS; c++) {
+         if (hdr.code[c] != RD_ABSENT) counts[(hdr.num_blocks - 1) * sigma + hdr.code[c]] = count[c];
+      }
+   }
+   r = 0;
+   for (i = 0; i < hdr.num_lookup; i++) {
+      unsigned int pos = i << hdr.lookup_shift;
+      while (r + 1 < hdr.num_runs && starts[r + 1] <= pos) r++;
+      lookup[i] = r;
+   }
+
+   FILE *idx = fopen(idx_file_loc,"w+");
+   if (idx == NULL) {
+      free(starts);
+      free(counts);
+      free(lookup);
+      free(heads);
+      unmap_file(m);
+      return FALSE;
+   }
+   fseek(idx,INDEX_HEADER_SIZE,SEEK_SET);
+   fwrite(&hdr,sizeof(hdr),1,idx);
+   fwrite(starts,sizeof(int),hdr.num_runs + 1,idx);
+   fwrite(counts,sizeof(int),hdr.num_blocks * sigma,idx);
+   fwrite(lookup,sizeof(int),hdr.num_lookup,idx);
+   fwrite(heads,1,hdr.num_runs,idx);
+   pad_to_section(idx);
+   unsigned int sections_offset = ftell(idx);
+   int written = finish_index(idx,m->base,size,freq,IDX_RUNLENGTH,RUN_BLOCK,sections_offset);
+
+   free(starts);
+   free(counts);
+   free(lookup);
+   free(heads);
+   unmap_file(m);
+   return written;
+}
+
+/*
+   Create a wavelet index (IDX_WAVELET). Each level is built from the
+   codes in the order the level above leaves them, then stably split 
+   into its zeros and ones for the next: the build keeps two copies of 
+   the codes and the lines of one level in memory.
+   @return: FALSE if the BWT cannot be read or the index written
+*/
+static int create_wavelet_idx (const char *idx_file_loc, FILE *bwt) {
+   mapping m = map_file(bwt);
+   if (m == NULL) return FALSE;
+   if (!bwt_size_fits(m->size)) {
+      unmap_file(m);
+      return FALSE;
+   }
+   const unsigned char *data = m->base + BWT_OFFSET;
+   unsigned int size = m->size - BWT_OFFSET;
+   unsigned int freq[MAX_CHARS] = {0};
+   unsigned int i, c, l, k;
+
+   struct _wavelet_header hdr;
+   memset(&hdr,0,sizeof(hdr));
+   memcpy(hdr.magic,WAVELET_MAGIC,8);
+   for (i = 0; i < size; i++) freq[data[i]]++;
+   for (c = 0; c < MAX_CHARS; c++) {
+      if (freq[c] > 0) {
+         hdr.symbol[hdr.sigma] = c;
+         hdr.code[c] = hdr.sigma++;
+      }
+      else hdr.code[c] = RD_ABSENT;
+   }
+   hdr.num_levels = 1;
+   while ((1U << hdr.num_levels) < hdr.sigma) hdr.num_levels++;
+   hdr.num_lines = size / WT_LINE_BITS + 1;
+   hdr.lines_offset = (sizeof(wavelet_header) + 7) & ~7;
+
+   size_t level_words = (size_t) hdr.num_lines * WT_LINE_WORDS;
+   unsigned char *codes = malloc(size + 1);
+   unsigned char *next = malloc(size + 1);
+   uint64_t *lines = malloc(sizeof(uint64_t) * level_words);
+   FILE *idx = fopen(idx_file_loc,"w+");
+   if (codes == NULL || next == NULL || lines == NULL || idx == NULL) {
+      if (idx != NULL) fclose(idx);
+      free(codes);
+      free(next);
+      free(lines);
+      unmap_file(m);
+      return FALSE;
+   }
+   for (i = 0; i < size; i++) codes[i] = hdr.code[data[i]];
+   fseek(idx,INDEX_HEADER_SIZE + hdr.lines_offset,SEEK_SET);
+   for (l = 0; l < hdr.num_levels; l++) {
+      unsigned int shift = hdr.num_levels - 1 - l;
+      uint64_t ones = 0;
+      memset(lines,0,sizeof(uint64_t) * level_words);
+      for (i = 0; i < size; i++) {
+         if ((codes[i] >> shift) & 1) {
+            lines[(size_t) (i / WT_LINE_BITS) * WT_LINE_WORDS + 1 + i % WT_LINE_BITS / 64] |= 1ULL << (i % 64);
+         }
+      }
+      for (i = 0; i < hdr.num_lines; i++) {
+         uint64_t *line = lines + (size_t) i * WT_LINE_WORDS;
+         line[0] = ones;
+         for (k = 1; k < WT_LINE_WORDS; k++) ones += __builtin_popcountll(line[k]);
+      }
+      hdr.zeros[l] = size - ones;
+      unsigned int zero = 0;
+      unsigned int one = hdr.zeros[l];
+      for (i = 0; i < size; i++) {
+         if ((codes[i] >> shift) & 1) next[one++] = codes[i];
+         else next[zero++] = codes[i];
+      }
+      unsigned char *t = codes;
+      codes = next;
+      next = t;
+      fwrite(lines,sizeof(uint64_t),level_words,idx);
+   }
+   for (i = size; i-- > 0;) hdr.start[codes[i]] = i;
+   pad_to_section(idx);
+   unsigned int sections_offset = ftell(idx);
+   // the header is only complete once every level is split
+   fseek(idx,INDEX_HEADER_SIZE,SEEK_SET);
+   fwrite(&hdr,sizeof(hdr),1,idx);
+   fseek(idx,sections_offset,SEEK_SET);
+   int written = finish_index(idx,m->base,size,freq,IDX_WAVELET,WT_LINE_BITS,sections_offset);
+
+   free(codes);
+   free(next);
+   free(lines);
+   unmap_file(m);
+   return written;
+}
+
+/*
+   Create an interleaved index (IDX_INTERLEAVED): blocks of whole cache
+   lines, each the counts of the characters in the BWT before it and 
+   the power of two BWT bytes that makes the counts at most a third of
+   the block, then the select samples and the C[] table.
+   @return: FALSE if the BWT cannot be read or the index written
+*/
+static int create_interleaved_idx (const char *idx_file_loc, FILE *bwt) {
+   mapping m = map_file(bwt);
+   if (m == NULL) return FALSE;
+   if (!bwt_size_fits(m->size)) {
+      unmap_file(m);
+      return FALSE;
+   }
+   const unsigned char *data = m->base + BWT_OFFSET;
+   unsigned int size = m->size - BWT_OFFSET;
+   unsigned int freq[MAX_CHARS] = {0};
+   unsigned int count[MAX_CHARS] = {0};
+   unsigned char symbols[MAX_CHARS];
+   unsigned int i, c, k;
+
+   struct _interleaved_header hdr;
+   memset(&hdr,0,sizeof(hdr));
+   memcpy(hdr.magic,INTERLEAVED_MAGIC,8);
+   for (i = 0; i < size; i++) freq[data[i]]++;
+   for (c = 0; c < MAX_CHARS; c++) {
+      if (freq[c] > 0) {
+         symbols[hdr.sigma] = c;
+         hdr.code[c] = hdr.sigma++;
+      }
+      else hdr.code[c] = RD_ABSENT;
+   }
+   unsigned int counts_size = hdr.sigma * sizeof(int);
+   hdr.payload = IL_MIN_PAYLOAD;
+   while (hdr.payload < 2 * counts_size) hdr.payload *= 2;
+   hdr.payload_shift = __builtin_ctz(hdr.payload);
+   hdr.block_size = (counts_size + hdr.payload + IL_LINE - 1) / IL_LINE * IL_LINE;
+   // a last block for position bwt_size even when the bytes fill every block
+   hdr.num_blocks = size / hdr.payload + 1;
+   hdr.blocks_offset = (sizeof(interleaved_header) + IL_LINE - 1) / IL_LINE * IL_LINE;
+
+   FILE *idx = fopen(idx_file_loc,"w+");
+   unsigned char *blocks = calloc(IDX_WRITE_BLOCKS,hdr.block_size);
+   if (idx == NULL || blocks == NULL) {
+      if (idx != NULL) fclose(idx);
+      free(blocks);
+      unmap_file(m);
+      return FALSE;
+   }
+   fseek(idx,INDEX_HEADER_SIZE,SEEK_SET);
+   fwrite(&hdr,sizeof(hdr),1,idx);
+   fseek(idx,INDEX_HEADER_SIZE + hdr.blocks_offset,SEEK_SET);
+   unsigned int num_buffered = 0;
+   unsigned int pos = 0;
+   for (i = 0; i < hdr.num_blocks; i++) {
+      unsigned char *b = blocks + (size_t) num_buffered * hdr.block_size;
+      unsigned int len = (size - pos < hdr.payload) ? size - pos : hdr.payload;
+      for (k = 0; k < hdr.sigma; k++) ((unsigned int *) b)[k] = count[symbols[k]];
+      memcpy(b + counts_size,data + pos,len);
+      memset(b + counts_size + len,0,hdr.block_size - counts_size - len);
+      for (k = 0; k < len; k++) count[data[pos + k]]++;
+      pos += len;
+      num_buffered++;
+      if (num_buffered == IDX_WRITE_BLOCKS || i + 1 == hdr.num_blocks) {
+         fwrite(blocks,hdr.block_size,num_buffered,idx);
+         num_buffered = 0;
+      }
+   }
+   free(blocks);
+
+   // Sampled select positions go between the blocks and the C[] table
+   unsigned int sections_offset = ftell(idx);
+   write_select_samples(idx,data,size,freq);
+   int written = finish_index(idx,m->base,size,freq,IDX_INTERLEAVED,hdr.payload,sections_offset);
+   unmap_file(m);
+   return written;
+}
+
+/*
+   Write the select samples section: the position of every
+   SELECT_SAMPLE_RATE'th occurrence of each character.
+   @params: *data is the BWT, *freq the # occurrences of each character
+*/
+static void write_select_samples (FILE *idx, const unsigned char *data, unsigned int size, unsigned int *freq) {
+   struct _select_header hdr;
+   unsigned int seen[MAX_CHARS] = {0};
+   unsigned int next[MAX_CHARS];
+   unsigned int i;
+   int c;
+   memset(&hdr,0,sizeof(hdr));
+   memcpy(hdr.magic,SELECT_MAGIC,8);
+   hdr.rate = SELECT_SAMPLE_RATE;
+   for (c = 0; c < MAX_CHARS; c++) {
+      hdr.start[c] = hdr.num_samples;
+      next[c] = hdr.num_samples;
+      hdr.num_samples += freq[c] / SELECT_SAMPLE_RATE;
+   }
+   hdr.start[MAX_CHARS] = hdr.num_samples;
+
+   unsigned int *samples = malloc(sizeof(int) * (hdr.num_samples + 1));
+   for (i = 0; i < size; i++) {
+      c = data[i];
+      if (++seen[c] % SELECT_SAMPLE_RATE == 0) samples[next[c]++] = i;
+   }
+   fwrite(&hdr,sizeof(hdr),1,idx);
+   fwrite(samples,sizeof(int),hdr.num_samples,idx);
+   free(samples);
+}
+
+/*
+   Look for the optional sections (select samples, suffix array and
+   inverse suffix array samples) between offset and end. Each starts on
+   an 8 byte boundary. An index without them leaves their pointers NULL.
+*/
+static void find_sections (table st, unsigned int offset, unsigned int end) {
+   const unsigned char *base = st->idx_map->base;
+   while ((offset = (offset + 7) & ~7u) + 8 <= end) {
+      if (memcmp(base + offset,SELECT_MAGIC,8) == 0 && section_fits(offset,sizeof(select_header),end)) {
+         select_samples sel = (select_samples) (base + offset);
+         uint64_t size = sizeof(select_header) + (uint64_t) sel->num_samples * sizeof(int);
+         int c;
+         if (sel->rate == 0 || !section_fits(offset,size,end)) break;
+         for (c = 0; c < MAX_CHARS; c++) {
+            if (sel->start[c] > sel->start[c + 1]) break;
+         }
+         if (c < MAX_CHARS || sel->start[MAX_CHARS] > sel->num_samples) break;
+         st->sel = sel;
+         st->sel_pos = (const unsigned int *) (base + offset + sizeof(select_header));
+         offset += size;
+      }
+      else if (memcmp(base + offset,SA_MAGIC,8) == 0 && section_fits(offset,sizeof(sa_header),end)) {
+         sa_samples sa = (sa_samples) (base + offset);
+         uint64_t marks = offset + sizeof(sa_header);
+         uint64_t ranks = marks + (uint64_t) sa->num_words * sizeof(uint64_t);
+         uint64_t pos = ranks + (uint64_t) sa->num_ranks * sizeof(int);
+         uint64_t size = pos + (uint64_t) sa->num_samples * sizeof(int) - offset;
+         // every row has a mark bit, every word of marks a stored rank
+         if (sa->rate == 0 || !section_fits(offset,size,end) ||
+             (uint64_t) sa->num_words * 64 < st->bwt_size ||
+             sa->num_ranks < sa->num_words / SA_RANK_WORDS + 1) break;
+         st->sa = sa;
+         st->sa_marks = (const uint64_t *) (base + marks);
+         st->sa_ranks = (const unsigned int *) (base + ranks);
+         st->sa_pos = (const unsigned int *) (base + pos);
+         offset += size;
+      }
+      else if (memcmp(base + offset,ISA_MAGIC,8) == 0 && section_fits(offset,sizeof(isa_header),end)) {
+         isa_samples isa = (isa_samples) (base + offset);
+         uint64_t size = sizeof(isa_header) + (uint64_t) isa->num_samples * sizeof(int);
+         if (isa->rate == 0 || !section_fits(offset,size,end)) break;
+         st->isa = isa;
+         st->isa_rows = (const unsigned int *) (base + offset + sizeof(isa_header));
+         offset += size;
+      }
+      else {
+         break;
+      }
+   }
+}
+
+// Whether size bytes from offset end by end
+static int section_fits (uint64_t offset, uint64_t size, uint64_t end) {
+   return offset <= end && size <= end - offset;
+}
+
+// Whether every character has a column below sigma, or none
+static int codes_fit (const unsigned short *code, unsigned int sigma) {
+   int c;
+   if (sigma > MAX_CHARS) return FALSE;
+   for (c = 0; c < MAX_CHARS; c++) {
+      if (code[c] != RD_ABSENT && code[c] >= sigma) return FALSE;
+   }
+   return TRUE;
+}
+
+/*
+   Check the rank data of the mapped index against the space before its
+   optional sections: each table the header points to has to lie there
+   in full and cover every BWT position a rank or select can ask for.
+   The header check in index_matches() only reads the fixed fields.
+   @return: FALSE if a read could run past the rank data
+*/
+static int rank_data_fits (table st) {
+   uint64_t end = st->info->sections_offset - st->info->rank_offset;
+   uint64_t n = st->bwt_size;
+   if (st->idx_format == IDX_RANKDIR) {
+      rank_dir rd = st->rd;
+      if (!codes_fit(rd->code,rd->sigma) || rd->block_size == 0 || 
+          rd->superblock_size < rd->block_size || rd->num_blocks <= n / rd->block_size ||
+          rd->num_superblocks <= (rd->num_blocks - 1) / (rd->superblock_size / rd->block_size)) return FALSE;
+      return section_fits(sizeof(rank_dir_header),(uint64_t) rd->num_blocks * rd->sigma * sizeof(uint16_t),rd->super_offset)
+          && section_fits(rd->super_offset,(uint64_t) rd->num_superblocks * rd->sigma * sizeof(uint64_t),end);
+   }
+   if (st->idx_format == IDX_RUNLENGTH) {
+      run_length rl = st->rl;
+      if (!codes_fit(rl->code,rl->sigma) || rl->num_runs == 0 || rl->lookup_shift >= 32 ||
+          rl->num_lookup <= (n - 1) >> rl->lookup_shift ||
+          rl->num_blocks <= (rl->num_runs - 1) / RUN_BLOCK) return FALSE;
+      return section_fits(rl->starts_offset,((uint64_t) rl->num_runs + 1) * sizeof(int),end)
+          && section_fits(rl->counts_offset,(uint64_t) rl->num_blocks * rl->sigma * sizeof(int),end)
+          && section_fits(rl->lookup_offset,(uint64_t) rl->num_lookup * sizeof(int),end)
+          && section_fits(rl->heads_offset,rl->num_runs,end);
+   }
+   if (st->idx_format == IDX_WAVELET) {
+      wavelet wt = st->wt;
+      if (!codes_fit(wt->code,wt->sigma) || wt->num_levels > WT_MAX_LEVELS ||
+          (uint64_t) wt->num_lines * WT_LINE_BITS <= n) return FALSE;
+      return section_fits(wt->lines_offset,(uint64_t) wt->num_levels * wt->num_lines * WT_LINE_WORDS * sizeof(uint64_t),end);
+   }
+   if (st->idx_format == IDX_INTERLEAVED) {
+      interleaved il = st->il;
+      if (!codes_fit(il->code,il->sigma) || il->payload_shift >= 32 ||
+          il->payload != 1u << il->payload_shift || il->num_blocks <= n >> il->payload_shift ||
+          il->block_size < il->sigma * sizeof(int) + il->payload) return FALSE;
+      return section_fits(il->blocks_offset,(uint64_t) il->num_blocks * il->block_size,end);
+   }
+   checkpoint ck = st->ck;
+   if (!codes_fit(ck->code,ck->sigma)) return FALSE;
+   return section_fits(ck->blocks_offset,(uint64_t) st->num_blocks * ck->sigma * sizeof(int),end);
+}
+
+/*
+   Add a sampled suffix array (sa_rate > 0) and/or sampled inverse suffix
+   array (isa_rate > 0) to an existing index. One LF walk through the 
+   whole text from the row of the first character (text offset 0 sits at
+   st->last) finds the row of every text offset:
+      SA:  marks each row whose offset is a multiple of sa_rate
+      ISA: keeps the row of each offset that is a multiple of isa_rate
+   The tail of the index is then rewritten as [new sections][C[] table].
+   st must hold the loaded index; it has to be reloaded afterwards.
+   @return: FALSE if the index cannot be rewritten
+*/
+static int add_samples (const char *idx_file_loc, table st, unsigned int sa_rate, unsigned int isa_rate) {
+   struct _sa_header hdr;
+   struct _isa_header isa_hdr;
+   unsigned int n = st->bwt_size;
+   unsigned int row = st->last;
+   unsigned int offset = 0;
+   unsigned int i, k;
+   uint64_t *marks = NULL;
+   unsigned int *ranks = NULL;
+   unsigned int *pairs = NULL;
+   unsigned int *samples = NULL;
+   unsigned int *isa = NULL;
+   memset(&hdr,0,sizeof(hdr));
+   memset(&isa_hdr,0,sizeof(isa_hdr));
+   if (sa_rate > 0) {
+      memcpy(hdr.magic,SA_MAGIC,8);
+      hdr.rate = sa_rate;
+      hdr.num_words = n / 64 + 1;
+      hdr.num_ranks = hdr.num_words / SA_RANK_WORDS + 1;
+      hdr.num_samples = (n + sa_rate - 1) / sa_rate;
+      marks = calloc(hdr.num_words,sizeof(uint64_t));
+      ranks = malloc(sizeof(int) * hdr.num_ranks);
+      pairs = malloc(sizeof(int) * 2 * (hdr.num_samples + 1));
+   }
+   if (isa_rate > 0) {
+      memcpy(isa_hdr.magic,ISA_MAGIC,8);
+      isa_hdr.rate = isa_rate;
+      isa_hdr.num_samples = (n + isa_rate - 1) / isa_rate;
+      isa = malloc(sizeof(int) * (isa_hdr.num_samples + 1));
+   }
+   k = 0;
+   // text offsets n - 1, n - 2, ... follow offset 0 in LF order
+   for (i = 0; i < n; i++) {
+      if (sa_rate > 0 && offset % sa_rate == 0) {
+         marks[row / 64] |= (uint64_t) 1 << (row % 64);
+         pairs[2 * k] = row;
+         pairs[2 * k + 1] = offset;
+         k++;
+      }
+      if (isa_rate > 0 && offset % isa_rate == 0) isa[offset / isa_rate] = row;
+      row = lf(st,row);
+      offset = (offset == 0) ? n - 1 : offset - 1;
+   }
+   if (sa_rate > 0) {
+      // sort (row, offset) pairs by row
+      qsort(pairs,k,sizeof(int) * 2,compare_uint);
+      samples = malloc(sizeof(int) * (k + 1));
+      for (i = 0; i < k; i++) samples[i] = pairs[2 * i + 1];
+      unsigned int seen = 0;
+      for (i = 0; i < hdr.num_words; i++) {
+         if (i % SA_RANK_WORDS == 0) ranks[i / SA_RANK_WORDS] = seen;
+         seen += __builtin_popcountll(marks[i]);
+      }
+   }
+
+   // keep the C[] table, then cut it off and write the sections and C[]
+   unsigned char ctable[C_TABLE_OFFSET];
+   struct _index_header info = *st->info;
+   memcpy(ctable,st->idx_map->base + info.ctable_offset,C_TABLE_OFFSET);
+   FILE *idx = fopen(idx_file_loc,"r+");
+   int written = FALSE;
+   if (idx != NULL && ftruncate(fileno(idx),info.ctable_offset) == 0) {
+      fseek(idx,0,SEEK_END);
+      if (sa_rate > 0) {
+         pad_to_section(idx);
+         fwrite(&hdr,sizeof(hdr),1,idx);
+         fwrite(marks,sizeof(uint64_t),hdr.num_words,idx);
+         fwrite(ranks,sizeof(int),hdr.num_ranks,idx);
+         fwrite(samples,sizeof(int),hdr.num_samples,idx);
+      }
+      if (isa_rate > 0) {
+         pad_to_section(idx);
+         fwrite(&isa_hdr,sizeof(isa_hdr),1,idx);
+         fwrite(isa,sizeof(int),isa_hdr.num_samples,idx);
       }
+      info.ctable_offset = ftell(idx);
+      fwrite(ctable,1,C_TABLE_OFFSET,idx);
+      fseek(idx,0,SEEK_SET);
+      fwrite(&info,sizeof(info),1,idx);
+      written = !ferror(idx);
    }
+   if (idx != NULL && fclose(idx) != 0) written = FALSE;
+
+   free(marks);
+   free(ranks);
+   free(pairs);
+   free(samples);
+   free(isa);
+   return written;
+}
+
+// Zero fill up to the 8 byte boundary the next section starts on
+static void pad_to_section (FILE *idx) {
+   while (ftell(idx) % 8 != 0) fputc(0,idx);
+}
+
+static int compare_uint (const void *a, const void *b) {
+   unsigned int x = *(const unsigned int *) a;
+   unsigned int y = *(const unsigned int *) b;
+   return (x > y) - (x < y);
+}
+
+static void c_table_from_idx (table st) {
+   st->ctable = malloc(sizeof(int) * (MAX_CHARS + 1));
+   memcpy(st->ctable,st->idx_map->base + st->info->ctable_offset,
+          sizeof(int) * MAX_CHARS);
+   // C[0] and C[1] are never written by create_c_table()
+   st->ctable[0] = 0;
+   st->ctable[1] = 0;
+   // get_last_occurence() may look one past the last character
+   st->ctable[MAX_CHARS] = st->bwt_size;
+   build_f_lookup(st);
+}
+
+/*
+   Cheap identity of a BWT: FNV-1a over its size, its end row and
+   FINGERPRINT_SPANS spans spread evenly over it (all of it if small),
+   so checking an index costs the same for any BWT size.
+*/
+static uint64_t bwt_fingerprint (const unsigned char *bwt, unsigned int size, unsigned int last) {
+   uint64_t hash = 14695981039346656037ULL;
+   unsigned int words[2] = {size, last};
+   const unsigned char *p = (const unsigned char *) words;
+   unsigned int i, j;
+   for (i = 0; i < sizeof(words); i++) hash = (hash ^ p[i]) * 1099511628211ULL;
+   if (size <= FINGERPRINT_SPANS * FINGERPRINT_SPAN) {
+      for (i = 0; i < size; i++) hash = (hash ^ bwt[i]) * 1099511628211ULL;
+      return hash;
+   }
+   for (i = 0; i < FINGERPRINT_SPANS; i++) {
+      uint64_t start = (uint64_t) (size - FINGERPRINT_SPAN) * i / (FINGERPRINT_SPANS - 1);
+      for (j = 0; j < FINGERPRINT_SPAN; j++) hash = (hash ^ bwt[start + j]) * 1099511628211ULL;
+   }
+   return hash;
+}
+
+/*
+   Check an index header against the BWT file it is used with and 
+   against the index's own size.
+   @params: *idx, *bwt are the whole files
+   @return: TRUE if the index was built from this BWT by this version
+*/
+static int index_matches (const unsigned char *idx, size_t idx_size, const unsigned char *bwt, size_t bwt_size) {
+   struct _index_header info;
+   unsigned int last;
+   if (idx_size < INDEX_HEADER_SIZE + C_TABLE_OFFSET || bwt_size < BWT_OFFSET) return FALSE;
+   memcpy(&info,idx,sizeof(info));
+   memcpy(&last,bwt,sizeof(last));
+   if (memcmp(info.magic,INDEX_MAGIC,8) != 0) return FALSE;
+   if (info.version != INDEX_VERSION) return FALSE;
+   if (info.format == IDX_CHECKPOINT && 
+       (info.rank_interval < MIN_RANK_INTERVAL || info.rank_interval > RANK_INTERVAL ||
+        (info.rank_interval & (info.rank_interval - 1)) != 0)) return FALSE;
+   if (info.format != IDX_CHECKPOINT && info.format != IDX_RANKDIR && 
+       info.format != IDX_RUNLENGTH && info.format != IDX_WAVELET &&
+       info.format != IDX_INTERLEAVED) return FALSE;
+   if (info.bwt_size != bwt_size - BWT_OFFSET || info.last != last) return FALSE;
+   if (info.rank_offset != INDEX_HEADER_SIZE) return FALSE;
+   if (info.sections_offset > info.ctable_offset) return FALSE;
+   if ((size_t) info.ctable_offset + C_TABLE_OFFSET != idx_size) return FALSE;
+   if (info.format == IDX_CHECKPOINT && 
+       (info.sections_offset < info.rank_offset + sizeof(checkpoint_header) ||
+        memcmp(idx + info.rank_offset,CHECKPOINT_MAGIC,8) != 0)) return FALSE;
+   if (info.format == IDX_RANKDIR && 
+       (info.sections_offset < info.rank_offset + sizeof(rank_dir_header) ||
+        memcmp(idx + info.rank_offset,RANK_DIR_MAGIC,8) != 0)) return FALSE;
+   if (info.format == IDX_RUNLENGTH && 
+       (info.sections_offset < info.rank_offset + sizeof(run_length_header) ||
+        memcmp(idx + info.rank_offset,RUN_LENGTH_MAGIC,8) != 0)) return FALSE;
+   if (info.format == IDX_WAVELET && 
+       (info.sections_offset < info.rank_offset + sizeof(wavelet_header) ||
+        memcmp(idx + info.rank_offset,WAVELET_MAGIC,8) != 0)) return FALSE;
+   if (info.format == IDX_INTERLEAVED && 
+       (info.sections_offset < info.rank_offset + sizeof(interleaved_header) ||
+        memcmp(idx + info.rank_offset,INTERLEAVED_MAGIC,8) != 0)) return FALSE;
+   return info.fingerprint == bwt_fingerprint(bwt + BWT_OFFSET,info.bwt_size,last);
+}
+
+/*
+   @return: TRUE if idx is an index of bwt that this version can use,
+            FALSE if it has to be rebuilt
+*/
+static int index_is_current (FILE *bwt, FILE *idx) {
+   mapping b = map_file(bwt);
+   mapping i = map_file(idx);
+   int current = (b != NULL && i != NULL && index_matches(i->base,i->size,b->base,b->size));
+   unmap_file(b);
+   unmap_file(i);
+   return current;
+}
+
+/*
+   Fill in the header at the start of a freshly written index.
+   @params: *bwt_file is the whole BWT file, bwt_size the # bytes after 
+            its header
+*/
+static void write_index_header (FILE *idx, const unsigned char *bwt_file, unsigned int bwt_size, unsigned int format, unsigned int rank_interval, unsigned int sections_offset, unsigned int ctable_offset) {
+   struct _index_header info;
+   memset(&info,0,sizeof(info));
+   memcpy(info.magic,INDEX_MAGIC,8);
+   info.version = INDEX_VERSION;
+   info.format = format;
+   info.rank_interval = rank_interval;
+   info.bwt_size = bwt_size;
+   memcpy(&info.last,bwt_file,sizeof(info.last));
+   info.rank_offset = INDEX_HEADER_SIZE;
+   info.sections_offset = sections_offset;
+   info.ctable_offset = ctable_offset;
+   info.fingerprint = bwt_fingerprint(bwt_file + BWT_OFFSET,bwt_size,info.last);
+   fseek(idx,0,SEEK_SET);
+   fwrite(&info,sizeof(info),1,idx);
+}
+
+/*
+   Write the C[] table where idx is, then the header, and close idx.
+   @params: *freq holds the # of each character in the BWT
+   @return: TRUE if every write and the close went through
+*/
+static int finish_index (FILE *idx, const unsigned char *bwt_file, unsigned int bwt_size, unsigned int *freq, unsigned int format, unsigned int rank_interval, unsigned int sections_offset) {
    // Create C[] table and store at end of index file
-   unsigned int *ctable = create_c_table(count);
+   long end = ftell(idx);
+   // every offset in the header is 32 bits
+   if (end < 0 || (uint64_t) end + C_TABLE_OFFSET > 0xFFFFFFFFu) {
+      fclose(idx);
+      return FALSE;
+   }
+   unsigned int ctable_offset = end;
+   unsigned int *ctable = create_c_table(freq);
    fwrite (ctable,sizeof(int),MAX_CHARS,idx);
-//   printf("C_TABLE:\n");
-//   print_c_table(ctable);
-   
    free (ctable);
+   write_index_header(idx,bwt_file,bwt_size,format,rank_interval,sections_offset,ctable_offset);
+   int written = !ferror(idx);
+   return (fclose(idx) == 0) && written;
+}
 
-   fclose(idx);
+static unsigned int get_last_char_pos (table st) {
+   // The first 4 bytes of the file hold the location of the 
+   // end of BWT character
+   unsigned int last;
+   memcpy(&last,st->bwt_map->base,sizeof(last));
+   return last;
 }
 
-static void c_table_from_idx (table st, FILE *idx) {
-   st->ctable = malloc(sizeof(int) * MAX_CHARS);
-   fseek(idx,-C_TABLE_OFFSET,SEEK_END);
-   fread(st->ctable,sizeof(int),MAX_CHARS,idx);
+int get_last_char (table st,int position) {   
+   return bwt_char(st,position);
 }
 
-static unsigned int get_last_char_pos (FILE *bwt) {
-   rewind(bwt);
-   // Get the first 4 bytes of the file to find the location of the 
-   // end of BWT character
-   unsigned char bytes[4];
-   fread(bytes,1,4,bwt);
-   // Convert first four bytes into integer 
-   // TODO: Might have to add +1 to this number.
-   unsigned int last = *(unsigned int*)bytes;
-   return last;
+/*
+   The BWT character at a position. A run-length index has it as the
+   head of the position's run, a wavelet index reads it off its levels
+   and an interleaved one from the block that covers it.
+*/
+static int bwt_char (table st, unsigned int pos) {
+   if (st->idx_format == IDX_RUNLENGTH) return st->rl_heads[run_of_position(st,pos)];
+   if (st->idx_format == IDX_WAVELET) return wavelet_access(st,pos);
+   if (st->idx_format == IDX_INTERLEAVED) {
+      return interleaved_block(st,pos >> st->il->payload_shift)[st->il->sigma * sizeof(int) + (pos & (st->il->payload - 1))];
+   }
+   return st->bwt_data[pos];
+}
+
+
+static unsigned int get_bwt_size (table st) {
+   return st->bwt_map->size - BWT_OFFSET;
+}
+
+/*
+   Whether a BWT file of file_size bytes can be searched: it holds the
+   last row, and every row and position of the rest fits in an int.
+*/
+static int bwt_size_fits (size_t file_size) {
+   return file_size >= BWT_OFFSET && file_size - BWT_OFFSET <= MAX_BWT_SIZE;
+}
+
+static unsigned int get_idx_size (table st) {
+   return st->idx_map->size;
+}
+
+/*
+   Map the whole of a file read only.
+   @params: *f is an open file
+   @return: the mapping (base is NULL for an empty file), or NULL if the
+            file cannot be mapped
+*/
+static mapping map_file (FILE *f) {
+   struct stat sb;
+   if (fstat(fileno(f),&sb) == -1) return NULL;
+   mapping m = malloc(sizeof(mapped_file));
+   m->base = NULL;
+   m->size = sb.st_size;
+   if (m->size > 0) {
+      m->base = mmap(NULL,m->size,PROT_READ,MAP_SHARED,fileno(f),0);
+      if (m->base == MAP_FAILED) {
+         free(m);
+         return NULL;
+      }
+   }
+   return m;
+}
+
+static void unmap_file (mapping m) {
+   if (m == NULL) return;
+   if (m->base != NULL) munmap(m->base,m->size);
+   free(m);
+}
+
+/*
+   Map the BWT and index files and fill in the symbol table so that
+   every rank, select and LF step works on plain pointers.
+   @return: FALSE if a file cannot be mapped or the index does not match
+*/
+static int map_bwt_and_idx (table st, FILE *bwt, FILE *idx) {
+   st->bwt_map = map_file(bwt);
+   st->idx_map = map_file(idx);
+   // the caller rebuilds a stale index, one that still does not match is rejected
+   if (st->bwt_map == NULL || st->idx_map == NULL || !bwt_size_fits(st->bwt_map->size) ||
+       !index_matches(st->idx_map->base,st->idx_map->size,st->bwt_map->base,st->bwt_map->size)) {
+      unmap_bwt_and_idx(st);
+      return FALSE;
+   }
+   st->info = (index_info) st->idx_map->base;
+   st->bwt_data = st->bwt_map->base + BWT_OFFSET;
+   st->idx_data = (const unsigned int *) (st->idx_map->base + st->info->rank_offset);
+   st->bwt_size = get_bwt_size(st);
+   st->idx_size = get_idx_size(st);
+   st->last = get_last_char_pos(st);
+   st->idx_format = st->info->format;
+   if (st->idx_format == IDX_RANKDIR) {
+      st->rd = (rank_dir) st->idx_data;
+      st->rd_blocks = (const uint16_t *) ((const unsigned char *) st->rd + sizeof(rank_dir_header));
+      st->rd_super = (const uint64_t *) ((const unsigned char *) st->rd + st->rd->super_offset);
+      st->code = st->rd->code;
+   }
+   else if (st->idx_format == IDX_RUNLENGTH) {
+      const unsigned char *base = (const unsigned char *) st->idx_data;
+      st->rl = (run_length) base;
+      st->rl_starts = (const unsigned int *) (base + st->rl->starts_offset);
+      st->rl_counts = (const unsigned int *) (base + st->rl->counts_offset);
+      st->rl_lookup = (const unsigned int *) (base + st->rl->lookup_offset);
+      st->rl_heads = base + st->rl->heads_offset;
+      st->code = st->rl->code;
+   }
+   else if (st->idx_format == IDX_WAVELET) {
+      const unsigned char *base = (const unsigned char *) st->idx_data;
+      st->wt = (wavelet) base;
+      st->wt_lines = (const uint64_t *) (base + st->wt->lines_offset);
+      st->wt_load = __sync_add_and_fetch(&wt_loads,1);
+      st->code = st->wt->code;
+   }
+   else if (st->idx_format == IDX_INTERLEAVED) {
+      st->il = (interleaved) st->idx_data;
+      st->il_blocks = (const unsigned char *) st->il + st->il->blocks_offset;
+      st->code = st->il->code;
+   }
+   else {
+      st->ck = (checkpoint) st->idx_data;
+      st->ck_blocks = (const unsigned int *) ((const unsigned char *) st->ck + st->ck->blocks_offset);
+      st->ck_shift = __builtin_ctz(st->info->rank_interval);
+      st->num_blocks = st->bwt_size >> st->ck_shift;
+      st->code = st->ck->code;
+   }
+   if (!rank_data_fits(st)) {
+      unmap_bwt_and_idx(st);
+      return FALSE;
+   }
+   find_sections(st,st->info->sections_offset,st->info->ctable_offset);
+   // the BWT mostly gets visited at random by LF
+   madvise(st->bwt_map->base,st->bwt_map->size,MADV_RANDOM);
+   return TRUE;
+}
+
+static void unmap_bwt_and_idx (table st) {
+   unmap_file(st->bwt_map);
+   unmap_file(st->idx_map);
+   st->bwt_map = NULL;
+   st->idx_map = NULL;
+   st->bwt_data = NULL;
+   st->idx_data = NULL;
+   st->info = NULL;
+}
+
+/*
+   Map the files and read everything the search needs from the index.
+   @return: FALSE if the index cannot be used with the BWT
+*/
+static int load_index (table st, FILE *bwt, FILE *idx) {
+   if (!map_bwt_and_idx(st,bwt,idx)) return FALSE;
+   c_table_from_idx(st);
+   return TRUE;
+}
+
+static void unload_index (table st) {
+   free(st->ctable);
+   free(st->f_lookup);
+   st->ctable = NULL;
+   st->f_lookup = NULL;
+   st->sel = NULL;
+   st->sa = NULL;
+   st->isa = NULL;
+   unmap_bwt_and_idx(st);
+}
+
+/*
+   Given a character frequency array, create and return an array
+   that stores how many characters are lexicographically less than a given
+   character.
+   @params: *freq is the character frequency array.
+   @return: C[] table (int*)
+*/
+static unsigned int * create_c_table (unsigned int *freq) {
+   int i;   
+   unsigned int count = 0;
+   unsigned int *c = malloc(sizeof(int)* (MAX_CHARS + 1));
+   c[0] = 0;
+   c[1] = 0;
+   for (i = 1; i < MAX_CHARS; i++ ) {
+      if (freq[i] > 0) count += freq[i];
+      c[i + 1] = count;
+   }
+   return c;
+}
+
+
+static table new_symbol_table() {
+   table newTable = malloc(sizeof(symbol_table));
+   newTable->ctable = NULL;
+   newTable->num_lines = 0;
+   newTable->bwt_size = 0;
+   newTable->last = 0;
+   newTable->idx_size = 0;
+   newTable->info = NULL;
+   newTable->num_blocks = 0;
+   newTable->idx_format = IDX_CHECKPOINT;
+   newTable->code = NULL;
+   newTable->ck = NULL;
+   newTable->ck_blocks = NULL;
+   newTable->ck_shift = 0;
+   newTable->rd = NULL;
+   newTable->rd_super = NULL;
+   newTable->rd_blocks = NULL;
+   newTable->rl = NULL;
+   newTable->rl_starts = NULL;
+   newTable->rl_counts = NULL;
+   newTable->rl_lookup = NULL;
+   newTable->rl_heads = NULL;
+   newTable->wt = NULL;
+   newTable->wt_lines = NULL;
+   newTable->wt_load = 0;
+   newTable->il = NULL;
+   newTable->il_blocks = NULL;
+   newTable->sel = NULL;
+   newTable->sel_pos = NULL;
+   newTable->sa = NULL;
+   newTable->sa_marks = NULL;
+   newTable->sa_ranks = NULL;
+   newTable->sa_pos = NULL;
+   newTable->isa = NULL;
+   newTable->isa_rows = NULL;
+   newTable->f_lookup = NULL;
+   newTable->f_shift = 0;
+   newTable->bwt_data = NULL;
+   newTable->idx_data = NULL;
+   newTable->bwt_map = NULL;
+   newTable->idx_map = NULL;
+   return newTable;
+}
+
+/*
+   Find every line holding query, or only the first max_lines of those
+   lines (0 for all of them), and hand each to fn without its newline.
+   fn returning non zero stops the search.
+   @return: # matches of query
+*/
+static int search_lines (char *query,table st, int threads, int max_lines, line_callback fn, void *arg) {
+   int fnl[2]; // First and Last values
+   get_first_and_last (query,st,fnl);
+   // determine results
+   if ( fnl[LAST] < fnl[FIRST]) return 0;
+   int matches = fnl[LAST] - fnl[FIRST] + 1;
+   /*
+      NOW RECOVER STRING
+   */
+   arena results = new_arena();
+   result head;
+   if (max_lines > 0 && max_lines < matches) {
+      head = first_lines(fnl,st,max_lines,results);
+   }
+   else {
+      head = extract_results(fnl,st,threads,results);
+      // delete duplicate lines     
+      double start = stats_clock();
+      head = drop_duplicate_lines(head,fnl);
+      add_phase_time(PHASE_DEDUP,start);
+   }
+
+   // join the two halves of each line
+   double start = stats_clock();
+   char *line = NULL;
+   size_t cap = 0;
+   result t = head;
+   while (t != NULL) {
+      size_t len = (size_t) t->b_length + t->f_length;
+      while (cap < len) line = grow_line(line,&cap,FALSE);
+      if (t->b_length > 0) memcpy(line,t->b_string,t->b_length);
+      if (t->f_length > 0) memcpy(line + t->b_length,t->f_string,t->f_length);
+      if (fn(line,len,arg) != 0) break;
+      t = t->next;
+   }
+   free(line);
+   add_phase_time(PHASE_OUTPUT,start);
+   free_arena(results);
+   return matches;
+}
+
+/*
+   Find every line holding a string within max_errors of query: 
+   substitutions only, or with edits also inserted and deleted 
+   characters. The pattern is searched backwards as in 
+   get_first_and_last(), but each step branches on every character of
+   the BWT but '\n', so a match stays within one line. A branch stops 
+   when its errors plus the fewest errors the rest of the pattern needs
+   (approx_bounds()) go over max_errors. With edits every text string
+   is a single branch that carries its edit distances to the pattern
+   (approx_edit_step()), so the work does not grow with the number of 
+   alignments of a string. Every row the search ends on 
+   gets the fewest errors any branch reached it with. The rows are then
+   rebuilt as in search_lines(), fewest errors first, and each line goes
+   to fn once, with the errors of its best match. fn NULL only counts.
+   @params: max_errors is at least 0 and below |query| / 2
+   @return: # rows (text positions) a match ends on
+*/
+static int search_approx_lines (char *query,table st, int max_errors, int edits, int threads, int max_lines, approx_line_callback fn, void *arg) {
+   struct _approx_search s;
+   int c;
+   s.st = st;
+   s.query = (const unsigned char *) query;
+   s.length = strlen(query);
+   s.max_errors = max_errors;
+   s.edits = edits;
+   s.sigma = 0;
+   for (c = 1; c < MAX_CHARS; c++) {
+      if (c != '\n' && st->code[c] != RD_ABSENT) s.symbols[s.sigma++] = c;
+   }
+   s.hits = NULL;
+   s.num_hits = 0;
+   s.hits_cap = 0;
+   double start = stats_clock();
+   s.bound = malloc(sizeof(int) * (s.length + 1));
+   approx_bounds(&s);
+   if (edits) {
+      // a string within max_errors of query is at most that much longer
+      int depths = s.length + max_errors + 1;
+      s.columns = malloc(sizeof(int) * 2 * (s.length + 1) * depths);
+      int j;
+      for (j = 0; j <= s.length; j++) {
+         s.columns[j] = j;
+         s.columns[s.length + 1 + j] = max_errors + 1;
+      }
+      approx_edit_step(&s,0,1,st->bwt_size);
+      free(s.columns);
+   }
+   else {
+      approx_step(&s,s.length,1,st->bwt_size,0);
+   }
+   free(s.bound);
+   approx_hit segments;
+   int num_segments = approx_segments(&s,&segments);
+   free(s.hits);
+   add_phase_time(PHASE_INTERVAL,start);
+   int matches = 0;
+   int k;
+   for (k = 0; k < num_segments; k++) {
+      matches += segments[k].fnl[LAST] - segments[k].fnl[FIRST] + 1;
+   }
+   if (fn == NULL || matches == 0) {
+      free(segments);
+      return matches;
+   }
+
+   // open addressing set of the lines handed out, at most half full
+   unsigned int slots = 1;
+   unsigned int most = (max_lines > 0 && max_lines < matches) ? max_lines : matches;
+   while (slots < 2 * most) slots *= 2;
+   unsigned int *seen = malloc(sizeof(int) * slots);
+   memset(seen,0xFF,sizeof(int) * slots);
+   char *line = NULL;
+   size_t cap = 0;
+   int emitted = 0;
+   int stop = FALSE;
+   for (k = 0; k < num_segments && !stop; k++) {
+      int *fnl = segments[k].fnl;
+      int rows = fnl[LAST] - fnl[FIRST] + 1;
+      arena results = new_arena();
+      result head;
+      // at most emitted of the first max_lines are out already
+      if (max_lines > 0 && max_lines < rows) {
+         head = first_lines(fnl,st,max_lines,results);
+      }
+      else {
+         head = extract_results(fnl,st,threads,results);
+         start = stats_clock();
+         head = drop_duplicate_lines(head,fnl);
+         add_phase_time(PHASE_DEDUP,start);
+      }
+
+      start = stats_clock();
+      result t;
+      for (t = head; t != NULL && !stop; t = t->next) {
+         unsigned int slot = (t->id * 2654435761u) & (slots - 1);
+         while (seen[slot] != NO_LINE && seen[slot] != t->id) slot = (slot + 1) & (slots - 1);
+         if (seen[slot] == t->id) continue;
+         seen[slot] = t->id;
+         size_t len = (size_t) t->b_length + t->f_length;
+         while (cap < len) line = grow_line(line,&cap,FALSE);
+         if (t->b_length > 0) memcpy(line,t->b_string,t->b_length);
+         if (t->f_length > 0) memcpy(line + t->b_length,t->f_string,t->f_length);
+         emitted++;
+         if (fn(line,len,segments[k].errors,arg) != 0) stop = TRUE;
+         if (max_lines > 0 && emitted == max_lines) stop = TRUE;
+      }
+      add_phase_time(PHASE_OUTPUT,start);
+      free_arena(results);
+   }
+   free(line);
+   free(seen);
+   free(segments);
+   return matches;
+}
+
+/*
+   bound[i] is a lower bound on the errors query[0 .. i) needs: the 
+   number of pieces it splits into, right to left, where each piece is
+   the shortest one ending there that the text does not hold. Every
+   match of query[0 .. i) has an error inside each of those pieces. 
+*/
+static void approx_bounds (approx_search s) {
+   int i, j;
+   s->bound[0] = 0;
+   for (i = 1; i <= s->length; i++) {
+      int fnl[2] = {1, s->st->bwt_size};
+      int pieces = 0;
+      for (j = i - 1; j >= 0; j--) {
+         int c = s->query[j];
+         if (s->st->code[c] != RD_ABSENT) narrow_interval(c,s->st,fnl);
+         else fnl[LAST] = fnl[FIRST] - 1;
+         if (fnl[FIRST] > fnl[LAST]) {
+            pieces++;
+            fnl[FIRST] = 1;
+            fnl[LAST] = s->st->bwt_size;
+         }
+      }
+      s->bound[i] = pieces;
+   }
+}
+
+/*
+   Match query[0 .. i) backwards into the rows [first, last], which hold
+   the rest of the pattern with errors so far, one character of the
+   text against each pattern character.
+*/
+static void approx_step (approx_search s, int i, int first, int last, int errors) {
+   if (i == 0) {
+      add_approx_hit(s,first,last,errors);
+      return;
+   }
+   if (errors + s->bound[i] > s->max_errors) return;
+   int want = s->query[i - 1];
+   // out of errors: only the exact step is left
+   if (errors == s->max_errors) {
+      int fnl[2] = {first, last};
+      if (s->st->code[want] == RD_ABSENT) return;
+      narrow_interval(want,s->st,fnl);
+      if (fnl[FIRST] <= fnl[LAST]) approx_step(s,i - 1,fnl[FIRST],fnl[LAST],errors);
+      return;
+   }
+   int k;
+   for (k = 0; k < s->sigma; k++) {
+      int c = s->symbols[k];
+      int fnl[2] = {first, last};
+      narrow_interval(c,s->st,fnl);
+      if (fnl[FIRST] > fnl[LAST]) continue;
+      approx_step(s,i - 1,fnl[FIRST],fnl[LAST],errors + (c != want));
+   }
+}
+
+/*
+   Grow the text string of the rows [first, last], depth characters long,
+   by one character on the left, for every character that keeps some 
+   rows. Column depth holds, for each j, the fewest errors between the
+   string and the last j pattern characters: as[j] with the string's 
+   first character against a pattern character, ins[j] with it inserted.
+   The new column follows from it in O(|query|), and a string ends a 
+   match when as[|query|] is within max_errors, so it never starts or 
+   ends with an inserted character. A string is grown no further once
+   no column entry plus the bound on the pattern left is within bounds.
+   Counts above max_errors are kept at max_errors + 1.
+*/
+static void approx_edit_step (approx_search s, int depth, int first, int last) {
+   int m = s->length;
+   int over = s->max_errors + 1;
+   const int *as = s->columns + 2 * (m + 1) * depth;
+   const int *ins = as + m + 1;
+   int *next_as = s->columns + 2 * (m + 1) * (depth + 1);
+   int *next_ins = next_as + m + 1;
+   int k, j;
+   for (k = 0; k < s->sigma; k++) {
+      int c = s->symbols[k];
+      int fnl[2] = {first, last};
+      narrow_interval(c,s->st,fnl);
+      if (fnl[FIRST] > fnl[LAST]) continue;
+      next_as[0] = over;
+      next_ins[0] = over;
+      int grow = FALSE;
+      for (j = 1; j <= m; j++) {
+         int best = (as[j - 1] < ins[j - 1]) ? as[j - 1] : ins[j - 1];
+         int a = best + (c != s->query[m - j]);
+         if (next_as[j - 1] + 1 < a) a = next_as[j - 1] + 1;
+         // the first text character (depth 0) is never an insertion
+         int n = (depth == 0) ? over : ((as[j] < ins[j]) ? as[j] : ins[j]) + 1;
+         if (next_ins[j - 1] + 1 < n) n = next_ins[j - 1] + 1;
+         next_as[j] = (a < over) ? a : over;
+         next_ins[j] = (n < over) ? n : over;
+         if (j < m && ((a < n) ? a : n) + s->bound[m - j] <= s->max_errors) grow = TRUE;
+      }
+      if (next_as[m] <= s->max_errors) add_approx_hit(s,fnl[FIRST],fnl[LAST],next_as[m]);
+      if (grow && depth + 1 < m + s->max_errors) approx_edit_step(s,depth + 1,fnl[FIRST],fnl[LAST]);
+   }
+}
+
+static void add_approx_hit (approx_search s, int first, int last, int errors) {
+   if (s->num_hits == s->hits_cap) {
+      s->hits_cap = (s->hits_cap == 0) ? 64 : s->hits_cap * 2;
+      s->hits = realloc(s->hits,sizeof(approx_hit_object) * s->hits_cap);
+   }
+   approx_hit h = &s->hits[s->num_hits++];
+   h->fnl[FIRST] = first;
+   h->fnl[LAST] = last;
+   h->errors = errors;
+}
+
+/*
+   Cut the rows of the hits into disjoint runs, each with the fewest
+   errors of the hits holding it, into a new array (*segments) sorted by
+   errors and then by row. Neighbouring runs with the same errors are 
+   joined.
+   @return: # runs
+*/
+static int approx_segments (approx_search s, approx_hit *segments) {
+   // a hit opens at First and closes after Last: {row, errors * 2 + closes}
+   unsigned int *events = malloc(sizeof(int) * 4 * (s->num_hits + 1));
+   int num_events = 0;
+   int k;
+   for (k = 0; k < s->num_hits; k++) {
+      events[2 * num_events] = s->hits[k].fnl[FIRST];
+      events[2 * num_events++ + 1] = s->hits[k].errors * 2;
+      events[2 * num_events] = s->hits[k].fnl[LAST] + 1;
+      events[2 * num_events++ + 1] = s->hits[k].errors * 2 + 1;
+   }
+   qsort(events,num_events,sizeof(int) * 2,compare_uint);
+   int *open = calloc(s->max_errors + 1,sizeof(int));
+   approx_hit runs = malloc(sizeof(approx_hit_object) * (num_events + 1));
+   int num_runs = 0;
+   k = 0;
+   while (k < num_events) {
+      unsigned int row = events[2 * k];
+      for (; k < num_events && events[2 * k] == row; k++) {
+         open[events[2 * k + 1] / 2] += (events[2 * k + 1] & 1) ? -1 : 1;
+      }
+      if (k == num_events) break;
+      int errors = 0;
+      while (errors <= s->max_errors && open[errors] == 0) errors++;
+      if (errors > s->max_errors) continue;
+      int end = events[2 * k] - 1;
+      if (num_runs > 0 && runs[num_runs - 1].errors == errors 
+          && runs[num_runs - 1].fnl[LAST] == (int) row - 1) {
+         runs[num_runs - 1].fnl[LAST] = end;
+      }
+      else {
+         runs[num_runs].fnl[FIRST] = row;
+         runs[num_runs].fnl[LAST] = end;
+         runs[num_runs].errors = errors;
+         num_runs++;
+      }
+   }
+   qsort(runs,num_runs,sizeof(approx_hit_object),compare_hits);
+   free(open);
+   free(events);
+   *segments = runs;
+   return num_runs;
+}
+
+// Fewer errors first, then lower rows
+static int compare_hits (const void *a, const void *b) {
+   const struct _approx_hit *x = a;
+   const struct _approx_hit *y = b;
+   if (x->errors != y->errors) return x->errors - y->errors;
+   return x->fnl[FIRST] - y->fnl[FIRST];
+}
+
+/*
+   Count the occurrences of query.
+*/
+static int count_matches (char *query,table st) {
+   int fnl[2]; // First and Last values
+   get_first_and_last (query,st,fnl);
+   if ( fnl[LAST] < fnl[FIRST]) return 0;
+   return fnl[LAST] - fnl[FIRST] + 1;
+}
+
+/*
+   The text offset of every occurrence of query, in text order, in a new
+   array (*offsets, NULL if there are none) the caller frees.
+   @return: # matches of query
+*/
+static int locate_matches (char *query,table st, unsigned int **offsets) {
+   int fnl[2]; // First and Last values
+   *offsets = NULL;
+   get_first_and_last (query,st,fnl);
+   if ( fnl[LAST] < fnl[FIRST]) return 0;
+   int matches = fnl[LAST] - fnl[FIRST] + 1;
+   *offsets = malloc(sizeof(int) * matches);
+   int i;
+   for (i = 0; i < matches; i++) {
+      (*offsets)[i] = locate(st,fnl[FIRST] - 1 + i);
+   }
+   qsort(*offsets,matches,sizeof(int),compare_uint);
+   return matches;
 }
 
-int get_last_char (FILE *bwt,int position) {   
-   fseek(bwt,position + BWT_OFFSET,SEEK_SET);
-   int last_ch = getc(bwt);
-   return last_ch;
+/*
+   Decode text[offset, offset + length) into out. The walk starts at the
+   first inverse suffix array sample at or after the end of the range
+   and steps back to it, so it costs at most isa rate + length LF steps.
+   Without samples it starts at the end of the text.
+   @return: # bytes written, less than length at the end of the text
+*/
+static unsigned int extract (table st, unsigned int offset, unsigned int length, char *out) {
+   unsigned int n = st->bwt_size;
+   if (offset >= n) return 0;
+   if (length > n - offset) length = n - offset;
+   unsigned int end = offset + length;
+   // the sample after the last one is the start of the (cyclic) text
+   unsigned int pos = n;
+   unsigned int row = st->last;
+   if (st->isa != NULL) {
+      unsigned int k = end / st->isa->rate + (end % st->isa->rate != 0);
+      if (k < st->isa->num_samples) {
+         pos = k * st->isa->rate;
+         row = st->isa_rows[k];
+      }
+   }
+   COUNT_STAT(lf_steps,pos - offset);
+   for (; pos > end; pos--) {
+      int c = bwt_char(st,row);
+      row = st->ctable[c] + occ(c,row,st);
+   }
+   for (; pos > offset; pos--) {
+      int c = bwt_char(st,row);
+      out[pos - 1 - offset] = c;
+      row = st->ctable[c] + occ(c,row,st);
+   }
+   return length;
 }
 
-
-static unsigned int get_bwt_size (FILE *bwt) {
-   unsigned int size;
-   fseek(bwt,0,SEEK_END);
-   size = ftell(bwt) - BWT_OFFSET;
-   return size;
+/*
+   Text offset of the suffix at a BWT row: LF steps back one text position
+   at a time until a sampled row, at most rate - 1 steps away.
+*/
+static unsigned int locate (table st, unsigned int row) {
+   unsigned int steps = 0;
+   while (!(st->sa_marks[row / 64] & ((uint64_t) 1 << (row % 64)))) {
+      row = lf(st,row);
+      steps++;
+   }
+   // rank of the row among the marked rows
+   unsigned int word = row / 64;
+   unsigned int sample = st->sa_ranks[word / SA_RANK_WORDS];
+   unsigned int w;
+   for (w = word - word % SA_RANK_WORDS; w < word; w++) {
+      sample += __builtin_popcountll(st->sa_marks[w]);
+   }
+   sample += __builtin_popcountll(st->sa_marks[word] & (((uint64_t) 1 << (row % 64)) - 1));
+   return (st->sa_pos[sample] + steps) % st->bwt_size;
 }
 
-static unsigned int get_idx_size (FILE *idx) {
-   unsigned int size;
-   fseek(idx,0,SEEK_END);
-   size = ftell(idx);
-   return size;
+// LF mapping: the row of the suffix one text position earlier
+static unsigned int lf (table st, unsigned int row) {
+   int c = bwt_char(st,row);
+   COUNT_STAT(lf_steps,1);
+   return st->ctable[c] + occ(c,row,st);
 }
 
 /*
-   Given a character frequency array, create and return an array
-   that stores how many characters are lexicographically less than a given
-   character.
-   @params: *freq is the character frequency array.
-   @return: C[] table (int*)
+   Rebuild the line of every match in [First, Last], backwards then
+   forwards. Each match is independent, so with more than one thread 
+   the range is cut into consecutive slices, each slice is rebuilt into
+   its own list and the lists are joined in order. The result is the 
+   same list a single thread builds. Every slice fills an arena of its
+   own, which is merged into a once the slice is done.
 */
-static unsigned int * create_c_table (unsigned int *freq) {
-   int i;   
-   unsigned int count = 0;
-   unsigned int *c = malloc(sizeof(int)* (MAX_CHARS + 1));
-   
-   for (i = 1; i < MAX_CHARS; i++ ) {
-      if (freq[i] > 0) count += freq[i];
-      c[i + 1] = count;
+static result extract_results (int *fnl,table st, int threads, arena a) {
+   int matches = fnl[LAST] - fnl[FIRST] + 1;
+   if (threads > matches / MIN_MATCHES_PER_THREAD) threads = matches / MIN_MATCHES_PER_THREAD;
+   if (threads <= 1) {
+      double start = stats_clock();
+      result head = backwards_results(fnl,fnl,st,a);
+      add_phase_time(PHASE_BACKWARD,start);
+      start = stats_clock();
+      forward_results(fnl,head,st,a);
+      add_phase_time(PHASE_FORWARD,start);
+      return head;
    }
-   return c;
-}
 
-
-static table new_symbol_table() {
-   table newTable = malloc(sizeof(symbol_table));
-   newTable->ctable = NULL;
-   newTable->num_lines = 0;
-   newTable->bwt_size = 0;
-   return newTable;
+   extract_job jobs = malloc(sizeof(extract_job_object) * threads);
+   pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+   int started = 0;
+   int i;
+   for (i = 0; i < threads; i++) {
+      jobs[i].st = st;
+      jobs[i].fnl[FIRST] = fnl[FIRST] + (int) (((long long) matches * i) / threads);
+      jobs[i].fnl[LAST] = fnl[FIRST] + (int) (((long long) matches * (i + 1)) / threads) - 1;
+      jobs[i].range[FIRST] = fnl[FIRST];
+      jobs[i].range[LAST] = fnl[LAST];
+      jobs[i].results = new_arena();
+      jobs[i].head = NULL;
+      jobs[i].counted = (counting != NULL);
+      memset(&jobs[i].stats,0,sizeof(jobs[i].stats));
+   }
+   // slice 0 runs on this thread, as do slices that fail to start
+   for (i = 1; i < threads; i++) {
+      if (pthread_create(&workers[i],NULL,run_extract_job,&jobs[i]) != 0) break;
+      started = i;
+   }
+   run_extract_job(&jobs[0]);
+   for (i = started + 1; i < threads; i++) run_extract_job(&jobs[i]);
+   for (i = 1; i <= started; i++) pthread_join(workers[i],NULL);
+
+   // join the slices
+   result head = jobs[0].head;
+   result tail = head;
+   for (i = 1; i < threads; i++) {
+      while (tail->next != NULL) tail = tail->next;
+      tail->next = jobs[i].head;
+   }
+   struct _query_stats slices;
+   memset(&slices,0,sizeof(slices));
+   for (i = 0; i < threads; i++) {
+      merge_arena(a,jobs[i].results);
+      merge_query_stats(&slices,&jobs[i].stats,TRUE);
+   }
+   if (counting != NULL) merge_query_stats(counting,&slices,FALSE);
+   free(jobs);
+   free(workers);
+   return head;
 }
 
-void backwards_search (char *query,table st, FILE *bwt, FILE *idx) {
-   int fnl[2]; // First and Last values
-   get_first_and_last (query,st,bwt,idx,fnl);
-   // determine results
-   if ( fnl[LAST] < fnl[FIRST]) {
-      //TODO delete this output
-      printf("No matches found\n");
-   }
-   else {      
-      //TODO delete output
-      int matches = fnl[LAST] - fnl[FIRST] + 1;
-      printf("Number of matches = %d\n",matches);
-      /*
-         NOW RECOVER STRING
-      */
-      result head = backwards_results(fnl,st,bwt,idx); 
-      // delete duplicate lines     
-       
-      forward_results(fnl,head,st,bwt,idx);
-      
-      search_for_duplicate_lines(head);
-
-      sort_b_strings(head);
-
-//      result r = head;
-
-//      while (r != NULL) {
-//         char sorted[r->b_length];
-//         int i;
-//         int j = 0;
-//         for (i = r->b_length - 1; i >= 0; i--) {
-//            sorted[j] = r->b_string[i];
-//            j++;
-//         }
-//         for(j = 0; j < r->b_length; j++) {
-//            printf("%c",sorted[j]);
-//         }
-//         for(j = 0; j < r->f_length; j++) {
-//            printf("%c",r->f_string[j]);
-//         }
-//         printf("\n");
-//         r = r->next;
-//         
-//      }
-      
-      
-      // test:
-      result t = head;
-      while (t != NULL) {
-         int j;
-         for(j = 0; j < t->b_length; j++) {
-            printf("%c",t->b_string[j]);
-         }
-//         printf(" %s",query);
-         for(j = 0; j < t->f_length; j++) {
-            printf("%c",t->f_string[j]);
+/*
+   Rebuild only the first max_lines distinct lines in row order, which
+   are the first lines extract_results() and drop_duplicate_lines() give.
+   Matches are walked back one at a time until that many lines are found.
+   A walk that reaches a match row walked before is on that match's line
+   and stops there; any other walk reaches its line start, whose row 
+   identifies the line. Only the lines kept are rebuilt forwards.
+*/
+static result first_lines (int *fnl,table st, int max_lines, arena a) {
+   int last_ch = get_last_char(st,st->last);
+   int base = fnl[FIRST] - 1;
+   unsigned int *line_of = malloc(sizeof(int) * (fnl[LAST] - base));
+   // open addressing set of the lines kept, at most half full
+   unsigned int slots = 1;
+   while (slots < 2 * (unsigned int) max_lines) slots *= 2;
+   unsigned int *seen = malloc(sizeof(int) * slots);
+   memset(seen,0xFF,sizeof(int) * slots);
+   size_t cap = 0;
+   char *line = grow_line(NULL,&cap,TRUE);
+   result head = NULL;
+   result last = NULL;
+   int kept = 0;
+   int i;
+   for (i = base; i < fnl[LAST] && kept < max_lines; i++) {
+      double start = stats_clock();
+      size_t str_len = 0;
+      unsigned int id = NO_LINE;
+      int pos = i;
+      int c = bwt_char(st,pos);
+      while (c != last_ch && c != '\n') {
+         if (str_len == cap) line = grow_line(line,&cap,TRUE);
+         str_len++;
+         line[cap - str_len] = c;
+         pos = st->ctable[c] + occ(c,pos,st);
+         if (pos >= base && pos < i) {
+            id = line_of[pos - base];
+            break;
          }
-         printf("\n");
-         t = t->next;
+         c = bwt_char(st,pos);
       }
+      COUNT_STAT(lf_steps,str_len);
+      add_phase_time(PHASE_BACKWARD,start);
+      if (id == NO_LINE) id = pos;
+      line_of[i - base] = id;
+      unsigned int slot = (id * 2654435761u) & (slots - 1);
+      while (seen[slot] != NO_LINE && seen[slot] != id) slot = (slot + 1) & (slots - 1);
+      if (seen[slot] == id) continue;
+      seen[slot] = id;
+
+      result r = new_result(a);
+      r->id = id;
+      r->b_string = arena_copy(a,line + cap - str_len,str_len);
+      r->b_length = str_len;
+      int row[2] = {i + 1, i + 1};
+      start = stats_clock();
+      forward_results(row,r,st,a);
+      add_phase_time(PHASE_FORWARD,start);
+      if (head == NULL) head = r;
+      else last->next = r;
+      last = r;
+      kept++;
+   }
+   free(line);
+   free(seen);
+   free(line_of);
+   return head;
+}
 
-      free_results(head);      
-   }   
-   
-   
-   
-   return;
+static void *run_extract_job (void *arg) {
+   extract_job job = arg;
+   // slice 0 runs on the caller's thread, which counts on afterwards
+   query_stats caller = counting;
+   counting = job->counted ? &job->stats : NULL;
+   double start = stats_clock();
+   job->head = backwards_results(job->fnl,job->range,job->st,job->results);
+   add_phase_time(PHASE_BACKWARD,start);
+   start = stats_clock();
+   forward_results(job->fnl,job->head,job->st,job->results);
+   add_phase_time(PHASE_FORWARD,start);
+   counting = caller;
+   return NULL;
 }
 
 int count_results (result head) {
@@ -300,79 +2438,71 @@ int count_results (result head) {
    return count;
 }
 
-void free_results (result head) {
-   result cur = head;
-   while (cur != NULL) {
-      result temp = cur;
-      cur = cur->next;
-      if(temp->b_string != NULL) free(temp->b_string);
-      if(temp->f_string != NULL) free(temp->f_string);
-      if(temp != NULL) free(temp); 
-      temp = NULL;     
-      
-   }
-   
-   head = NULL;
-}
-
-void sort_b_strings(result head) {
+/*
+   Keep one result per line. A walk that stopped at another match row
+   (dup_of) is on the same line as that match; following dup_of ends at
+   the one match per line whose walk went all the way back. That result
+   takes the place of the line's first match in row order, which is 
+   where comparing ids kept it, and every other result is unlinked.
+   They all live in the query's arena, so nothing is freed here.
+   @params: *fnl is the [First, Last] of the whole list
+   @return: the new head
+*/
+result drop_duplicate_lines (result head, int *fnl) {
+   int matches = fnl[LAST] - fnl[FIRST] + 1;
+   int base = fnl[FIRST] - 1;
+   result *by_row = malloc(sizeof(result) * matches);
+   int *line = malloc(sizeof(int) * matches);
+   char *kept = calloc(matches,1);
+   int k, j;
    result r = head;
-
-   while (r != NULL) {
-      char *sorted = malloc(sizeof(char) * r->b_length);
-      int i;
-      int j = 0;
-      for (i = r->b_length - 1; i >= 0; i--) {
-         sorted[j] = r->b_string[i];
-         j++;
-      }
-      char * temp =  r->b_string;
-      r->b_string = sorted;
-      free(temp);
+   for (k = 0; k < matches; k++) {
+      by_row[k] = r;
+      line[k] = -1;
       r = r->next;
-      
    }
-}
-
-
-void search_for_duplicate_lines (result head){
-   result cur = head;
-//         result last = head;
-   result next = NULL;
-   int id;
-   while (cur != NULL) {
-      id = cur->id;
-      next = cur->next;
-      result before = cur;
-      while(next != NULL) {
-         if (next->id == id) {
-            result temp = next;
-            next = next->next;
-            before->next = next;
-            if(temp->b_string != NULL) free(temp->b_string);
-            if(temp->f_string != NULL) free(temp->f_string);
-            if(temp != NULL) free(temp); 
-//            free(temp->b_string);
-//            free(temp->f_string);
-//            free(temp);
-         }
-         else {
-            before = next;
-            next = next->next;
-         }
+   for (k = 0; k < matches; k++) {
+      // follow dup_of to the line's full walk, then point the path at it
+      j = k;
+      while (line[j] == -1 && by_row[j]->dup_of != NO_DUP) j = by_row[j]->dup_of - base;
+      int full = (line[j] == -1) ? j : line[j];
+      j = k;
+      while (line[j] == -1 && by_row[j]->dup_of != NO_DUP) {
+         line[j] = full;
+         j = by_row[j]->dup_of - base;
       }
-//            last = cur;
-      cur = cur->next;
+      line[j] = full;
+   }
+   result new_head = NULL;
+   result tail = NULL;
+   for (k = 0; k < matches; k++) {
+      int full = line[k];
+      if (kept[full]) continue;
+      kept[full] = TRUE;
+      if (tail == NULL) new_head = by_row[full];
+      else tail->next = by_row[full];
+      tail = by_row[full];
    }
+   if (tail != NULL) tail->next = NULL;
+   free(by_row);
+   free(line);
+   free(kept);
+   return new_head;
 }
 
 
-void forward_results(int *fnl,result head,table st, FILE *bwt, FILE *idx) {
+/*
+   Rebuild the rest of the line of every match that was walked back to
+   its line start, into a buffer reused from match to match. Each line
+   is copied into the arena once its length is known.
+*/
+void forward_results(int *fnl,result head,table st,arena a) {
    result cur = head;
    int i;
    int c = 0;
-   fseek(bwt,st->last + BWT_OFFSET,SEEK_SET);
-   int last_ch = getc(bwt);
+   int last_ch = get_last_char(st,st->last);
+   size_t cap = 0;
+   char *line = grow_line(NULL,&cap,FALSE);
 //   rewind(bwt);
    int result_count = 0;
 
@@ -380,151 +2510,197 @@ void forward_results(int *fnl,result head,table st, FILE *bwt, FILE *idx) {
    // Iterate through the results
    // MUST KEEP first - 1
    for (i = fnl[FIRST] - 1; i < fnl[LAST]; i++) {
+      // a duplicate line is dropped, do not rebuild it
+      if (cur->dup_of != NO_DUP) {
+         cur = cur->next;
+         continue;
+      }
       // create result, update links
-      int str_len = 0;
+      size_t str_len = 0;
       int pos = i;
-      int j;
       int f_occ;
       // get the character in F at pos
-      for(j = 0; j < MAX_CHARS; j++) {
-         if(st->ctable[j] <= pos) {
-            c = j;
-         }
-      }
+      c = f_column_char(st,pos);
       // store c
       while ( c != last_ch && c != '\n') {
-         cur->f_string[str_len] = c;
+         if (str_len == cap) line = grow_line(line,&cap,FALSE);
+         line[str_len] = c;
          str_len++;
-         if(str_len == (MAX_STRING_LEN -1)) printf("###########ERROR STRLEN AT MAX FORWARDS)");
-         //TODO delete this output
-//         printf("%c",c);      
          // get the next position   
          f_occ = pos - st->ctable[c] + 1;
          // get the bwt position of character c with rank = f_occ 
-         pos = pos_of_rank_c_in_bwt (c,f_occ,st,bwt,idx);
+         pos = pos_of_rank_c_in_bwt (c,f_occ,st);
          // get character in f at pos
-         for(j = 0; j < MAX_CHARS; j++) {
-            if(st->ctable[j] <= pos) {
-               c = j;
-            }
-         }               
+         c = f_column_char(st,pos);
       }
       result_count++;
+      cur->f_string = arena_copy(a,line,str_len);
       cur->f_length = str_len;   
       cur = cur->next;
    }
-
+   free(line);
 }
-// TODO IMPLEMENT BINARY SEARCH HERE
-int pos_of_rank_c_in_bwt (int c,int rank,table st, FILE *bwt, FILE *idx) {
-   // keep track of position in bwt
-   int pos = -1;  // initialise at -1 because of 0 base
-   int ch;
-   int idx_offset = 0;
-   int count = 0;
-   // Determine if the index file is needed
-   if (st->bwt_size < RANK_INTERVAL) {
-      // Go to the beginning of BWT file
-      fseek(bwt,BWT_OFFSET,SEEK_SET);
-      while (count != rank) {
-         pos++;
-         ch = getc(bwt);
-         if (ch == c) count++;
+/*
+   Position in the BWT of the occurrence of c with the given rank (from 1).
+   The select samples bracket the rank, a binary search over the index
+   boundaries in that bracket finds the last one before it, and a short
+   scan finishes the job.
+*/
+int pos_of_rank_c_in_bwt (int c,int rank,table st) {
+   unsigned int interval = boundary_interval(st);
+   unsigned int lo = 0;
+   unsigned int hi = num_boundaries(st) - 1;
+   unsigned int from = 0;     // where the final scan starts
+   unsigned int count = 0;    // occurrences of c before from
+   
+   COUNT_STAT(select_calls,1);
+   if (st->idx_format == IDX_RUNLENGTH) return run_length_select(c,rank,st);
+   if (st->idx_format == IDX_WAVELET) return wavelet_select(c,rank,st);
+   if (st->sel != NULL) {
+      unsigned int rate = st->sel->rate;
+      unsigned int k = rank / rate;    // # samples at or below the rank
+      const unsigned int *samples = st->sel_pos + st->sel->start[c];
+      unsigned int num = st->sel->start[c + 1] - st->sel->start[c];
+      if (k > 0) {
+         COUNT_STAT(idx_bytes,sizeof(int));
+         if (k * rate == (unsigned int) rank) return samples[k - 1];
+         from = samples[k - 1] + 1;
+         count = k * rate;
+         lo = from / interval;
       }
-   }
-   // Otherwise use index file
-   else {
-      int *index = (int*) malloc (sizeof(int) * MAX_CHARS);
-      rewind(idx);
-      fread(index,sizeof(int),MAX_CHARS,idx);
-      
-      if (index[c] >= rank) {
-         // Have to count from beginning of BWT file
-         fseek(bwt,BWT_OFFSET,SEEK_SET);
-         while (count != rank) {
-            pos++;
-            ch = getc(bwt);
-            if (ch == c) count++;
-         }
+      if (k < num) {
+         hi = samples[k] / interval;
+         COUNT_STAT(idx_bytes,sizeof(int));
       }
-      // not in the first interval
-      else {
-         int interval;  // first index interval
-         int max_interval = (st->bwt_size / RANK_INTERVAL);
-         int gone_past = FALSE;
-         for (interval = 1; interval < max_interval; interval++) {
-            idx_offset = (((interval * RANK_INTERVAL) - RANK_INTERVAL) / RANK_INTERVAL) * MAX_CHARS * sizeof(int);
-            fseek(idx,idx_offset,SEEK_SET);
-            fread(index,sizeof(int),MAX_CHARS,idx);
-            if (index[c] >= rank) {
-               gone_past = TRUE;
-               break;
-            }
-            
-         }
-         if (gone_past) {
-            interval--;
-            idx_offset = (((interval * RANK_INTERVAL) - RANK_INTERVAL) / RANK_INTERVAL) * MAX_CHARS * sizeof(int);
-//            idx_offset = interval * MAX_CHARS * sizeof(int);
-            fseek(idx,idx_offset,SEEK_SET);
-            fread(index,sizeof(int),MAX_CHARS,idx);
-            
-            pos = interval * RANK_INTERVAL;
-            fseek(bwt,BWT_OFFSET + pos,SEEK_SET);
-            count = index[c];
-            while (count != rank) {
-               pos++;
-               ch = getc(bwt);
-               if (ch == c) count++;
-            }
-            
-         }
-         // Must be inbetween the end of the last index block  
-         // and the end of the BWT. - WORST CASE
-         else {
-//            printf("####DEBUG pos_of_rank: START LAST AREA\n");
-//            idx_offset = (max_interval - 1) * MAX_CHARS * sizeof(int);
-idx_offset = ((((max_interval - 1) * RANK_INTERVAL) - RANK_INTERVAL) / RANK_INTERVAL) * MAX_CHARS * sizeof(int);
-            fseek(idx,idx_offset,SEEK_SET);
-            fread(index,sizeof(int),MAX_CHARS,idx);
-            pos = (max_interval - 1) * RANK_INTERVAL;
-            fseek(bwt,BWT_OFFSET + pos,SEEK_SET);
-            count = index[c];
-            while (count != rank) {
-               pos++;
-               ch = getc(bwt);
-               if (ch == c) count++;
-            }
-         }
+   }
+   // last boundary in [lo, hi] with fewer than rank occurrences before it
+   while (lo < hi) {
+      unsigned int mid = (lo + hi + 1) / 2;
+      if (boundary_rank(st,mid,c) < (unsigned int) rank) lo = mid;
+      else hi = mid - 1;
+   }
+   if (lo * interval > from) {
+      from = lo * interval;
+      count = boundary_rank(st,lo,c);
+   }
+   return select_scan(c,rank,st,from,count);
+}
 
+/*
+   Scan forward from position 'from', which has 'count' occurrences of c
+   before it, to the occurrence with the given rank. Whole steps are
+   skipped with the counting kernel. An interleaved index has the
+   occurrence in the block of from, and is scanned there.
+*/
+static int select_scan (int c, unsigned int rank, table st, unsigned int from, unsigned int count) {
+   const unsigned char *bwt = st->bwt_data;
+   unsigned int base = 0;              // BWT position of bwt[0]
+   unsigned int end = st->bwt_size;
+   unsigned int start = from;
+   if (st->idx_format == IDX_INTERLEAVED) {
+      unsigned int block = from >> st->il->payload_shift;
+      base = block << st->il->payload_shift;
+      bwt = interleaved_block(st,block) + st->il->sigma * sizeof(int);
+      if (base + st->il->payload < end) end = base + st->il->payload;
+   }
+   while (from + SELECT_SCAN_STEP <= end) {
+      unsigned int step = count_bytes(bwt + from - base,SELECT_SCAN_STEP,c);
+      if (count + step >= rank) break;
+      count += step;
+      from += SELECT_SCAN_STEP;
+   }
+   while (TRUE) {
+      if (bwt[from - base] == c) {
+         count++;
+         if (count == rank) break;
       }
+      from++;
+   }
+   COUNT_STAT(bwt_bytes,from + 1 - start);
+   return from;
+}
+
+/*
+   The index boundaries are the positions in the BWT whose ranks the
+   index stores: every checkpoint interval (boundary 0 is the start) or
+   every rank directory or interleaved block.
+*/
+static unsigned int num_boundaries (table st) {
+   if (st->idx_format == IDX_RANKDIR) return st->rd->num_blocks;
+   if (st->idx_format == IDX_INTERLEAVED) return st->il->num_blocks;
+   return st->num_blocks + 1;
+}
+
+static unsigned int boundary_interval (table st) {
+   if (st->idx_format == IDX_RANKDIR) return st->rd->block_size;
+   if (st->idx_format == IDX_INTERLEAVED) return st->il->payload;
+   return st->info->rank_interval;
+}
 
-      free(index);
-//      fseek(bwt,BWT_OFFSET,SEEK_SET);
-//      int debugcount = 0;
-//      int debugpos = -1;
-//      while (debugcount != rank) {
-//         debugpos++;
-//         ch = getc(bwt);
-//         if (ch == c) debugcount++;
-//      }
-//      printf("DEBUGPOS = %d, POS = %d\n",debugpos,pos);
-      pos--;
+static unsigned int boundary_rank (table st, unsigned int boundary, int c) {
+   if (st->idx_format == IDX_RANKDIR) {
+      COUNT_STAT(idx_bytes,sizeof(uint64_t) + sizeof(uint16_t));
+      COUNT_STAT(blocks,1);
+      return rank_dir_boundary(st,boundary,st->rd->code[c]);
    }
+   if (st->idx_format == IDX_INTERLEAVED) {
+      if (st->code[c] == RD_ABSENT) return 0;
+      COUNT_STAT(idx_bytes,sizeof(int));
+      COUNT_STAT(blocks,1);
+      return ((const unsigned int *) interleaved_block(st,boundary))[st->code[c]];
+   }
+   // checkpoint block k holds the counts of the first (k + 1) intervals
+   if (boundary == 0 || st->code[c] == RD_ABSENT) return 0;
+   COUNT_STAT(idx_bytes,sizeof(int));
+   COUNT_STAT(blocks,1);
+   return st->ck_blocks[(boundary - 1) * st->ck->sigma + st->code[c]];
+}
 
-   return pos;
+/*
+   The F column is the sorted BWT, so the character at a row is the last 
+   one whose C[] value is at or below the row. Remember that character 
+   at the start of each bucket of rows; finding it for any row then only
+   has to step over the characters that start inside its bucket.
+*/
+static void build_f_lookup (table st) {
+   unsigned int buckets;
+   unsigned int b;
+   int c = 0;
+   st->f_shift = 0;
+   while ((st->bwt_size >> st->f_shift) >= (1u << F_LOOKUP_BITS)) st->f_shift++;
+   buckets = (st->bwt_size >> st->f_shift) + 1;
+   st->f_lookup = malloc(buckets);
+   for (b = 0; b < buckets; b++) {
+      unsigned int pos = b << st->f_shift;
+      while (c < MAX_CHARS - 1 && st->ctable[c + 1] <= pos) c++;
+      st->f_lookup[b] = c;
+   }
+}
+
+static int f_column_char (table st, unsigned int pos) {
+   int c = st->f_lookup[pos >> st->f_shift];
+   while (c < MAX_CHARS - 1 && st->ctable[c + 1] <= pos) c++;
+   return c;
 }
 
 
-result backwards_results (int *fnl,table st, FILE *bwt, FILE *idx){
+/*
+   Rebuild the start of the line of every match in fnl, walking back
+   to the line terminator. A walk that reaches another match row in
+   range (all the matches) is on that match's line: it stops there and 
+   records the row in dup_of, so each line is walked once however many
+   matches it holds. The walk fills a buffer from its end, so the line
+   comes out in text order without being reversed.
+*/
+result backwards_results (int *fnl,int *range,table st,arena a){
    result head = NULL;
    result last = NULL;
    int i;
    int c = 0;
-   fseek(bwt,st->last + BWT_OFFSET,SEEK_SET);
-   int last_ch = getc(bwt);
-   rewind(bwt);
+   int last_ch = get_last_char(st,st->last);
    int result_count = 0;
+   size_t cap = 0;
+   char *line = grow_line(NULL,&cap,TRUE);
 
    /*
       BACKWARDS
@@ -534,52 +2710,66 @@ result backwards_results (int *fnl,table st, FILE *bwt, FILE *idx){
    // MUST KEEP first - 1
    for (i = fnl[FIRST] - 1; i < fnl[LAST]; i++) {
       // create result, update links
-      result r = new_result();
+      result r = new_result(a);
       if(result_count == 0 ) {
          head = r;         
       }
       else {
          last->next = r;
       }
-      int str_len = 0;
+      size_t str_len = 0;
       int pos = i;
-      fseek(bwt,pos + BWT_OFFSET,SEEK_SET);
-      c = getc(bwt);
+      c = bwt_char(st,pos);
       // Get the string
       while ( c != last_ch && c != '\n') {
-         r->b_string[str_len] = c;
+         if (str_len == cap) line = grow_line(line,&cap,TRUE);
          str_len++;
-         if(str_len == (MAX_STRING_LEN - 1)) printf("###########ERROR STRLEN AT MAX BACKWARDS)");
-         //TODO delete this output
-//         printf("%c",c);      
+         line[cap - str_len] = c;
          // get the next position      
-         pos = st->ctable[c] + occ(c,pos,bwt,idx);
-         fseek(bwt,pos + BWT_OFFSET,SEEK_SET);
+         pos = st->ctable[c] + occ(c,pos,st);
+         // another match further left on this line
+         if (pos >= range[FIRST] - 1 && pos < range[LAST]) {
+            r->dup_of = pos;
+            break;
+         }
          // get character
-         c = getc(bwt);               
+         c = bwt_char(st,pos);
       }
+      COUNT_STAT(lf_steps,str_len);
       // set r->id to '\n' position in bwt
-      r->id = ftell(bwt) - 1;
-      r->b_length = str_len;
-//         printf("%s",query);
-      //TODO delete this output
-//      if (c == '\n') {
-//         printf("%c",c);
-//      }
+      r->id = pos;
+      // a duplicate line is dropped, its start is not kept
+      if (r->dup_of == NO_DUP) {
+         r->b_string = arena_copy(a,line + cap - str_len,str_len);
+         r->b_length = str_len;
+      }
       result_count++;
       // update link
       last = r;
    }
+   free(line);
    return head;
 }
 
 
-static void  get_first_and_last (char *query,table st, FILE *bwt, FILE *idx, int *fnl) {
+static void  get_first_and_last (char *query,table st, int *fnl) {
    // Get First and Last
 //   short int found_match;
    //initialise variables
    int i = strlen(query) - 1;          // i = |P|
-   int c = query[i];                   // 'c' = last character in P
+   int c = (unsigned char) query[i];   // 'c' = last character in P
+   double start = stats_clock();
+   int k;
+
+   // a character the BWT does not hold cannot match: no rank steps
+   for (k = 0; k <= i; k++) {
+      if (st->code[(unsigned char) query[k]] == RD_ABSENT) {
+         fnl[FIRST] = 1;
+         fnl[LAST] = 0;
+         add_phase_time(PHASE_INTERVAL,start);
+         return;
+      }
+   }
    int first = st->ctable[c] + 1;
    int last = get_last_occurence (st->ctable,c);
 //   printf("i = %d, c = %c, First = %d, Last = %d\n",i,c,first,last);
@@ -593,66 +2783,70 @@ static void  get_first_and_last (char *query,table st, FILE *bwt, FILE *idx, int
       i = i - 1
    }   
    */
-   while ((first <= last) && i >= 1) {
-      c = query[i - 1];
-      if (st->idx_size < RANK_INTERVAL) {
-         first = st->ctable[c] + occ_func(c,first - 1,bwt) + 1;
-         last = st->ctable[c] + occ_func(c,last,bwt);
-      }
-      else {
-         first = st->ctable[c] + occ(c,first - 1,bwt,idx) + 1;
-         last = st->ctable[c] + occ(c,last,bwt,idx);
-      }
+   fnl[FIRST] = first;
+   fnl[LAST] = last;
+   while ((fnl[FIRST] <= fnl[LAST]) && i >= 1) {
+      c = (unsigned char) query[i - 1];
+      narrow_interval(c,st,fnl);
       i--;
 //      printf("i = %d, c = %c, First = %d, Last = %d\n",i,c,first,last);
    }
-   fnl[FIRST] = first;
-   fnl[LAST] = last;
+   add_phase_time(PHASE_INTERVAL,start);
+}
 
+/*
+   One backward search step: [First, Last] becomes the rows whose suffix
+   is c followed by the suffix of one of the rows it was. All rows 
+   [1, bwt_size] go straight to the rows of c.
+*/
+static void narrow_interval (int c, table st, int *fnl) {
+   if (fnl[FIRST] == 1 && fnl[LAST] == (int) st->bwt_size) {
+      fnl[FIRST] = st->ctable[c] + 1;
+      fnl[LAST] = get_last_occurence(st->ctable,c);
+   }
+   else if (st->idx_format == IDX_CHECKPOINT && st->num_blocks == 0) {
+      COUNT_RANK(fnl[FIRST] - 1,0);
+      COUNT_RANK(fnl[LAST],0);
+      fnl[FIRST] = st->ctable[c] + occ_func(c,fnl[FIRST] - 1,st->bwt_data) + 1;
+      fnl[LAST] = st->ctable[c] + occ_func(c,fnl[LAST],st->bwt_data);
+   }
+   else {
+      fnl[FIRST] = st->ctable[c] + occ(c,fnl[FIRST] - 1,st) + 1;
+      fnl[LAST] = st->ctable[c] + occ(c,fnl[LAST],st);
+   }
 }
    
 
-unsigned int occ (int c, int position,FILE *bwt,FILE *idx) {
-   //TODO check if needed:
-   rewind (bwt);
-   rewind (idx);
-
+unsigned int occ (int c, int position,table st) {
    int rank;
+   if (st->idx_format == IDX_RANKDIR) return rank_dir_occ(c,position,st);
+   if (st->idx_format == IDX_RUNLENGTH) return run_length_occ(c,position,st);
+   if (st->idx_format == IDX_WAVELET) return wavelet_occ(c,position,st);
+   if (st->idx_format == IDX_INTERLEAVED) return interleaved_occ(c,position,st);
+   int code = st->ck->code[c];
+   // a character without a column never occurs
+   if (code == RD_ABSENT) {
+      COUNT_RANK(0,0);
+      return 0;
+   }
    // If rank is smaller than interval, don't use index
-   if (position <= RANK_INTERVAL) {
-      rank = occ_func(c,position,bwt);
+   if ((position >> st->ck_shift) == 0) {
+      COUNT_RANK(position,0);
+      rank = occ_func(c,position,st->bwt_data);
    }
    else {
-      int idx_offset;
-      // determine index offset
-      if (position >= RANK_INTERVAL && position < (RANK_INTERVAL * 2)) {
-         idx_offset = 0;
-      }
-      else {
-         idx_offset = ((position - RANK_INTERVAL)/RANK_INTERVAL) * MAX_CHARS * sizeof(int);
-      }
-      // get index block 
-      fseek(idx,idx_offset,SEEK_SET);
-      int * index = (int*) malloc (sizeof(int) * MAX_CHARS);
-      fread(index,sizeof(int),MAX_CHARS,idx);
+      // checkpoint block k holds the counts of the first (k + 1) intervals
+      const unsigned int *index = st->ck_blocks 
+                                + ((position >> st->ck_shift) - 1) * st->ck->sigma;
       // get the rank of character c from index block
-      unsigned int idx_rank = index[c];
-      // determine where to start counting from in the bwt file
-      int bwt_start = ((position / RANK_INTERVAL) * RANK_INTERVAL);
-      // go to the start position (add 4 byte offset)
-      fseek(bwt,(bwt_start + BWT_OFFSET),SEEK_SET);
-      int count = 0;
-      int i,ch;
+      unsigned int idx_rank = index[code];
+      // determine where to start counting from in the bwt
+      int bwt_start = (position >> st->ck_shift) << st->ck_shift;
+      COUNT_RANK(position - bwt_start,sizeof(int));
       // start bwt count from starting position to given position
-      for ( i = bwt_start; i < position; i++ ) {
-         ch = getc(bwt);
-         if (ch == c) count++; 
-      }
+      int count = occ_func_pos(c,position,st->bwt_data,bwt_start);
 
-//      printf("character: %c, position: %d, idx_int: %d, offset: %d, idx_rank: %d\n", c, position, interval,idx_offset,idx_rank);   
-//      printf("occ_func rank is: %d, bwt_offset: %d, count: %d\n",occ_func(c,position,bwt),bwt_start,count); 
       rank = idx_rank + count;
-      free(index);
    }
    return rank;
 
@@ -660,34 +2854,380 @@ unsigned int occ (int c, int position,FILE *bwt,FILE *idx) {
 
 
 // Occurrence function WITHOUT the use of index file in L Column
-int occ_func(int character,int position,FILE *bwt){
-//	rewind(bwt);
-   // Start at beginning of BWT section (add BWT OFFSET)
-   fseek(bwt,BWT_OFFSET,SEEK_SET);
-	int rank= 0;
-	int c;
-	int i;
-	for (i = 1; i <= position; i++){
-		(c = getc(bwt));
-		if (c == character) rank++;
-	}
-	return rank;
+int occ_func(int character,int position,const unsigned char *bwt){
+   return occ_func_pos(character,position,bwt,0);
 }
 
 
 // Occurrence function WITHOUT the use of index file in L Column
-int occ_func_pos(int character,int position,FILE *bwt,int from){
-//	rewind(bwt);
-   // Start at beginning of BWT section (add BWT OFFSET)
-   fseek(bwt,BWT_OFFSET + from,SEEK_SET);
-	int rank= 0;
-	int c;
-	int i;
-	for (i = from; i < position; i++){
-		(c = getc(bwt));
-		if (c == character) rank++;
-	}
-	return rank;
+int occ_func_pos(int character,int position,const unsigned char *bwt,int from){
+   if (position <= from) return 0;
+   return count_bytes(bwt + from,position - from,character);
+}
+
+/*
+   Byte counting kernels: # of bytes equal to c in data[0 .. len).
+   The widest one the CPU supports is picked once at start up.
+*/
+static unsigned int count_bytes_scalar (const unsigned char *data, unsigned int len, int c) {
+   unsigned int count = 0;
+   unsigned int i;
+   for (i = 0; i < len; i++) {
+      if (data[i] == c) count++;
+   }
+   return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+   Compare 16 bytes at a time. Each match is 0xFF (-1) so subtracting
+   the compare result counts matches per byte lane; the lanes are summed
+   with SAD before any of them can wrap.
+*/
+__attribute__((target("sse2")))
+static unsigned int count_bytes_sse2 (const unsigned char *data, unsigned int len, int c) {
+   const __m128i needle = _mm_set1_epi8((char) c);
+   const __m128i zero = _mm_setzero_si128();
+   __m128i total = _mm_setzero_si128();
+   unsigned int i = 0;
+   while (len - i >= 16) {
+      __m128i lanes = _mm_setzero_si128();
+      unsigned int rounds = 0;
+      for (; len - i >= 16 && rounds < 255; i += 16, rounds++) {
+         __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+         lanes = _mm_sub_epi8(lanes,_mm_cmpeq_epi8(v,needle));
+      }
+      total = _mm_add_epi64(total,_mm_sad_epu8(lanes,zero));
+   }
+   unsigned int count = _mm_cvtsi128_si32(total) 
+                      + _mm_cvtsi128_si32(_mm_unpackhi_epi64(total,total));
+   return count + count_bytes_scalar(data + i,len - i,c);
+}
+
+// As count_bytes_sse2() with 32 byte vectors
+__attribute__((target("avx2")))
+static unsigned int count_bytes_avx2 (const unsigned char *data, unsigned int len, int c) {
+   const __m256i needle = _mm256_set1_epi8((char) c);
+   const __m256i zero = _mm256_setzero_si256();
+   __m256i total = _mm256_setzero_si256();
+   unsigned int i = 0;
+   while (len - i >= 32) {
+      __m256i lanes = _mm256_setzero_si256();
+      unsigned int rounds = 0;
+      for (; len - i >= 32 && rounds < 255; i += 32, rounds++) {
+         __m256i v = _mm256_loadu_si256((const __m256i *) (data + i));
+         lanes = _mm256_sub_epi8(lanes,_mm256_cmpeq_epi8(v,needle));
+      }
+      total = _mm256_add_epi64(total,_mm256_sad_epu8(lanes,zero));
+   }
+   uint64_t sums[4];
+   _mm256_storeu_si256((__m256i *) sums,total);
+   unsigned int count = sums[0] + sums[1] + sums[2] + sums[3];
+   return count + count_bytes_sse2(data + i,len - i,c);
+}
+
+// 64 bytes at a time straight into a mask, the tail is done masked too
+__attribute__((target("avx512f,avx512bw,bmi2,popcnt")))
+static unsigned int count_bytes_avx512 (const unsigned char *data, unsigned int len, int c) {
+   const __m512i needle = _mm512_set1_epi8((char) c);
+   unsigned int count = 0;
+   unsigned int i = 0;
+   for (; len - i >= 64; i += 64) {
+      __m512i v = _mm512_loadu_si512((const void *) (data + i));
+      count += _mm_popcnt_u64(_mm512_cmpeq_epi8_mask(v,needle));
+   }
+   if (i < len) {
+      __mmask64 tail = _bzhi_u64(~0ULL,len - i);
+      __m512i v = _mm512_maskz_loadu_epi8(tail,(const void *) (data + i));
+      count += _mm_popcnt_u64(_mm512_mask_cmpeq_epi8_mask(tail,v,needle));
+   }
+   return count;
+}
+
+#endif
+
+__attribute__((constructor))
+static void select_count_kernel (void) {
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("bmi2")) {
+      count_bytes = count_bytes_avx512;
+   }
+   else if (__builtin_cpu_supports("avx2")) {
+      count_bytes = count_bytes_avx2;
+   }
+   else if (__builtin_cpu_supports("sse2")) {
+      count_bytes = count_bytes_sse2;
+   }
+#endif
+}
+
+/*
+   Seconds on a monotonic clock while this thread counts; 0, without
+   reading the clock, while it does not.
+*/
+static double stats_clock (void) {
+   if (counting == NULL) return 0;
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_phase_time (int phase, double start) {
+   if (counting != NULL) counting->phase_time[phase] += stats_clock() - start;
+}
+
+/*
+   Add the counters of from to into. The phases of parallel work (from
+   one of several threads running at once) take the longest thread's
+   time rather than the sum.
+*/
+static void merge_query_stats (query_stats into, query_stats from, int parallel) {
+   int p;
+   into->rank_calls += from->rank_calls;
+   into->select_calls += from->select_calls;
+   into->lf_steps += from->lf_steps;
+   into->bwt_bytes += from->bwt_bytes;
+   into->idx_bytes += from->idx_bytes;
+   into->blocks += from->blocks;
+   for (p = 0; p < NUM_PHASES; p++) {
+      if (!parallel) into->phase_time[p] += from->phase_time[p];
+      else if (from->phase_time[p] > into->phase_time[p]) into->phase_time[p] = from->phase_time[p];
+   }
+}
+
+/*
+   Rank of a character column at the start of a rank directory block.
+*/
+static unsigned int rank_dir_boundary (table st, unsigned int block, int code) {
+   unsigned int blocks_per_super = st->rd->superblock_size / st->rd->block_size;
+   unsigned int sigma = st->rd->sigma;
+   return st->rd_super[(block / blocks_per_super) * sigma + code]
+        + st->rd_blocks[block * sigma + code];
+}
+
+/*
+   Occurrences of c in the first 'position' characters of the BWT using
+   the rank directory. The scan runs from the nearest block boundary,
+   either forwards or backwards, so it covers at most half a block.
+*/
+static unsigned int rank_dir_occ (int c, unsigned int position, table st) {
+   int code = st->rd->code[c];
+   if (code == RD_ABSENT) {
+      COUNT_RANK(0,0);
+      return 0;
+   }
+   unsigned int block_size = st->rd->block_size;
+   unsigned int block = position / block_size;
+   unsigned int start = block * block_size;
+   if (position - start > block_size / 2 && block + 1 < st->rd->num_blocks) {
+      unsigned int end = start + block_size;
+      COUNT_RANK(end - position,sizeof(uint64_t) + sizeof(uint16_t));
+      return rank_dir_boundary(st,block + 1,code)
+           - occ_func_pos(c,end,st->bwt_data,position);
+   }
+   COUNT_RANK(position - start,sizeof(uint64_t) + sizeof(uint16_t));
+   return rank_dir_boundary(st,block,code)
+        + occ_func_pos(c,position,st->bwt_data,start);
+}
+
+/*
+   The run holding a BWT position: the lookup entries either side of it
+   bracket a binary search over the run starts.
+*/
+static unsigned int run_of_position (table st, unsigned int pos) {
+   unsigned int k = pos >> st->rl->lookup_shift;
+   unsigned int lo = st->rl_lookup[k];
+   unsigned int hi = (k + 1 < st->rl->num_lookup) ? st->rl_lookup[k + 1] : st->rl->num_runs - 1;
+   while (lo < hi) {
+      unsigned int mid = (lo + hi + 1) / 2;
+      if (st->rl_starts[mid] <= pos) lo = mid;
+      else hi = mid - 1;
+   }
+   return lo;
+}
+
+/*
+   Occurrences of c in the first 'position' characters of the BWT using
+   the runs: the counts before the block of runs of position - 1, plus
+   the c runs from the start of that block, the last one only in part.
+*/
+static unsigned int run_length_occ (int c, unsigned int position, table st) {
+   int code = st->rl->code[c];
+   if (code == RD_ABSENT || position == 0) {
+      COUNT_RANK(0,0);
+      return 0;
+   }
+   unsigned int run = run_of_position(st,position - 1);
+   unsigned int first = run - run % RUN_BLOCK;
+   unsigned int count = st->rl_counts[(run / RUN_BLOCK) * st->rl->sigma + code];
+   unsigned int j;
+   for (j = first; j < run; j++) {
+      if (st->rl_heads[j] == c) count += st->rl_starts[j + 1] - st->rl_starts[j];
+   }
+   if (st->rl_heads[run] == c) count += position - st->rl_starts[run];
+   COUNT_RANK(run - first + 1,sizeof(int));
+   return count;
+}
+
+/*
+   Position in the BWT of the occurrence of c with the given rank (from 1):
+   a binary search over the count rows finds the block of runs it is in,
+   and the c runs of that block are stepped over up to it.
+*/
+static int run_length_select (int c, unsigned int rank, table st) {
+   int code = st->rl->code[c];
+   unsigned int sigma = st->rl->sigma;
+   unsigned int lo = 0;
+   unsigned int hi = st->rl->num_blocks - 1;
+   while (lo < hi) {
+      unsigned int mid = (lo + hi + 1) / 2;
+      if (st->rl_counts[mid * sigma + code] < rank) lo = mid;
+      else hi = mid - 1;
+   }
+   unsigned int count = st->rl_counts[lo * sigma + code];
+   unsigned int j = lo * RUN_BLOCK;
+   COUNT_STAT(idx_bytes,sizeof(int));
+   while (TRUE) {
+      if (st->rl_heads[j] == c) {
+         unsigned int len = st->rl_starts[j + 1] - st->rl_starts[j];
+         if (count + len >= rank) break;
+         count += len;
+      }
+      j++;
+   }
+   COUNT_STAT(bwt_bytes,j - lo * RUN_BLOCK + 1);
+   return st->rl_starts[j] + (rank - count - 1);
+}
+
+/*
+   # ones among the first pos bits of a wavelet level: the count at the
+   start of pos's line plus a popcount of its words up to pos.
+*/
+static unsigned int wt_rank1 (table st, unsigned int level, unsigned int pos) {
+   const uint64_t *line = st->wt_lines + ((size_t) level * st->wt->num_lines + pos / WT_LINE_BITS) * WT_LINE_WORDS;
+   unsigned int bit = pos % WT_LINE_BITS;
+   unsigned int words = bit / 64;
+   unsigned int count = line[0];
+   unsigned int w;
+   for (w = 1; w <= words; w++) count += __builtin_popcountll(line[w]);
+   if (bit % 64 != 0) count += __builtin_popcountll(line[words + 1] & ((1ULL << (bit % 64)) - 1));
+   COUNT_STAT(idx_bytes,(words + 2) * sizeof(uint64_t));
+   COUNT_STAT(blocks,1);
+   return count;
+}
+
+/*
+   Position in a wavelet level of its bit with the given rank (from 1):
+   a binary search over the line counts finds the line, then a popcount
+   per word and a bit by bit step through the last word.
+*/
+static unsigned int wt_select (table st, unsigned int level, int bit, unsigned int rank) {
+   const uint64_t *lines = st->wt_lines + (size_t) level * st->wt->num_lines * WT_LINE_WORDS;
+   unsigned int lo = 0;
+   unsigned int hi = st->wt->num_lines - 1;
+   while (lo < hi) {
+      unsigned int mid = (lo + hi + 1) / 2;
+      uint64_t ones = lines[(size_t) mid * WT_LINE_WORDS];
+      uint64_t before = bit ? ones : (uint64_t) mid * WT_LINE_BITS - ones;
+      if (before < rank) lo = mid;
+      else hi = mid - 1;
+   }
+   const uint64_t *line = lines + (size_t) lo * WT_LINE_WORDS;
+   unsigned int count = bit ? line[0] : lo * WT_LINE_BITS - line[0];
+   unsigned int w = 1;
+   uint64_t word = bit ? line[w] : ~line[w];
+   while (count + __builtin_popcountll(word) < rank) {
+      count += __builtin_popcountll(word);
+      w++;
+      word = bit ? line[w] : ~line[w];
+   }
+   for (; count + 1 < rank; count++) word &= word - 1;
+   COUNT_STAT(idx_bytes,(w + 1) * sizeof(uint64_t));
+   return lo * WT_LINE_BITS + (w - 1) * 64 + __builtin_ctzll(word);
+}
+
+/*
+   Occurrences of c in the first 'position' characters of the BWT: the
+   position follows the bits of c's code down the levels, and below the
+   last one the c's before it lie between the start of c and it.
+*/
+static unsigned int wavelet_occ (int c, unsigned int position, table st) {
+   int code = st->wt->code[c];
+   unsigned int levels = st->wt->num_levels;
+   unsigned int l;
+   COUNT_RANK(0,0);
+   if (code == RD_ABSENT) return 0;
+   if (wt_last.load == st->wt_load && wt_last.pos == position && wt_last.c == c) return wt_last.rank;
+   for (l = 0; l < levels; l++) {
+      unsigned int ones = wt_rank1(st,l,position);
+      if ((code >> (levels - 1 - l)) & 1) position = st->wt->zeros[l] + ones;
+      else position -= ones;
+   }
+   return position - st->wt->start[code];
+}
+
+/*
+   The BWT character at a position, one bit of its code from each level.
+   Below the last level the position is also the character's rank there.
+*/
+static int wavelet_access (table st, unsigned int pos) {
+   unsigned int levels = st->wt->num_levels;
+   unsigned int code = 0;
+   unsigned int l;
+   wt_last.load = st->wt_load;
+   wt_last.pos = pos;
+   for (l = 0; l < levels; l++) {
+      const uint64_t *line = st->wt_lines + ((size_t) l * st->wt->num_lines + pos / WT_LINE_BITS) * WT_LINE_WORDS;
+      unsigned int bit = (line[1 + pos % WT_LINE_BITS / 64] >> (pos % 64)) & 1;
+      unsigned int ones = wt_rank1(st,l,pos);
+      pos = bit ? st->wt->zeros[l] + ones : pos - ones;
+      code = (code << 1) | bit;
+   }
+   wt_last.c = st->wt->symbol[code];
+   wt_last.rank = pos - st->wt->start[code];
+   return wt_last.c;
+}
+
+/*
+   Position in the BWT of the occurrence of c with the given rank (from 1):
+   from its place below the last level, a select on each level going up
+   finds where the occurrence came from.
+*/
+static int wavelet_select (int c, unsigned int rank, table st) {
+   int code = st->wt->code[c];
+   unsigned int levels = st->wt->num_levels;
+   unsigned int pos = st->wt->start[code] + rank - 1;
+   unsigned int l = levels;
+   while (l-- > 0) {
+      if ((code >> (levels - 1 - l)) & 1) pos = wt_select(st,l,1,pos - st->wt->zeros[l] + 1);
+      else pos = wt_select(st,l,0,pos + 1);
+   }
+   return pos;
+}
+
+static const unsigned char *interleaved_block (table st, unsigned int block) {
+   return st->il_blocks + (size_t) block * st->il->block_size;
+}
+
+/*
+   Occurrences of c in the first 'position' characters of the BWT: the
+   count at the start of the block that covers position plus a count of
+   the block's own BWT bytes up to it.
+*/
+static unsigned int interleaved_occ (int c, unsigned int position, table st) {
+   int code = st->il->code[c];
+   if (code == RD_ABSENT) {
+      COUNT_RANK(0,0);
+      return 0;
+   }
+   unsigned int block = position >> st->il->payload_shift;
+   unsigned int from = block << st->il->payload_shift;
+   const unsigned char *b = interleaved_block(st,block);
+   COUNT_RANK(position - from,sizeof(int));
+   return ((const unsigned int *) b)[code] 
+        + occ_func(c,position - from,b + st->il->sigma * sizeof(int));
 }
 
 static int get_last_occurence (unsigned int *ctable, int c) {
@@ -708,12 +3248,4 @@ void print_c_table (unsigned int *ctable) {
    return;
 }
 
-void print_stats (table st) {
-//   printf("NUM LINES = %d\n",st->num_lines);
-//   printf("FILE SIZE = %d BYTES\n",st->bwt_size);
-
-   printf("SIZE of BWT file is %d\n",st->bwt_size);
-   printf("SIZE of index file is %d\n",st->idx_size);
-
-}
 
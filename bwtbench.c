@@ -0,0 +1,543 @@
+/***********************************************************************
+************************************************************************
+***                                                                  ***
+***   Filename:  bwtbench.c                                          ***
+***   Purpose:   Benchmark of index building, rank, search, line     ***
+***              extraction and inversion                            ***
+***                                                                  ***
+************************************************************************
+***********************************************************************/
+
+/*
+   Usage:
+      bwtbench [-f <format>] [-s <MB>] [-j <threads>]
+         build synthetic corpora of BENCH_SIZES MB (or of <MB> only)
+         in every skew and time each step on them
+      bwtbench [-f <format>] [-j <threads>] -r <bwt>
+         time the same steps on an existing BWT file
+   Every index format (checkpoint, rankdir, runlength, wavelet,
+   interleaved) is timed unless -f picks one; -j is the # threads
+   create_idx may use (default 1). Every corpus is checked by comparing its unbwt with
+   the text it was built from.
+
+   One CSV row per corpus, index format and step goes to stdout:
+      corpus,format,bytes,idx_bytes,step,ops,seconds,mb_per_s,ops_per_s,p50_us,p90_us,p99_us,max_us
+   bytes is the size of the text and idx_bytes that of its index. create_idx and unbwt rows time whole runs; occ rows time batches of
+   OCC_BATCH calls and give the latency of one call; the search rows
+   time one call per pattern.
+*/
+
+
+/*********************************
+ **          #INCLUDES          **
+ *********************************/
+
+#include <time.h>
+// compiled in rather than linked, so each internal step can be timed
+#include "bwtlib.c"
+
+
+/*********************************
+ **          #DEFINES           **
+ *********************************/
+
+#define BENCH_SIZES {1, 4, 16}      // synthetic corpus sizes in MB
+#define NUM_SKEWS 3
+#define SKEW_UNIFORM 0              // 26 letters and space, all as likely
+#define SKEW_ZIPF 1                 // 64 symbols, the k'th 1/k as likely
+#define SKEW_REPEAT 2               // one block repeated with 0.1% changes
+#define ZIPF_SYMBOLS 64
+#define REPEAT_BLOCK 65536
+#define REPEAT_CHANGE 1000          // 1 in REPEAT_CHANGE bytes changed
+#define MIN_LINE 20                 // synthetic line lengths
+#define MAX_LINE 200
+
+#define NUM_PATTERNS 1000           // patterns sampled from each text
+#define MIN_PATTERN_LEN 4
+#define MAX_PATTERN_LEN 12
+#define OCC_QUERIES (1 << 20)
+#define OCC_BATCH 64
+#define BUILD_RUNS 3
+#define UNBWT_RUNS 3
+#define BENCH_SEED 9139
+#define NUM_FORMATS 5               // IDX_CHECKPOINT .. IDX_INTERLEAVED
+
+
+/*********************************
+ **        TYPE DEFINES         **
+ *********************************/
+
+/*
+   The CSV columns every row shares
+*/
+typedef struct _bench_row *bench_row;
+struct _bench_row {
+   char *corpus;
+   char *format;
+   unsigned int bytes;     // # bytes of text
+   unsigned int idx_bytes; // # bytes of index
+} bench_row_object;
+
+
+/*********************************
+ **      FUNCTION PROTOTYPES    **
+ *********************************/
+static void bench_synthetic (int size_mb, int format, int threads);
+static void bench_file (char *corpus, char *bwt_path, const unsigned char *text, int format, int threads);
+static void bench_format (bench_row row, char *bwt_path, const unsigned char *text, int format, int threads);
+static int build (bench_row row, char *idx_path, FILE *bwt, int format, int threads);
+static unsigned char *time_unbwt (bench_row row, table st, char *out_path);
+static void time_occ (bench_row row, table st, const unsigned char *text);
+static void time_search (bench_row row, table st, char **patterns);
+static char **sample_patterns (const unsigned char *text, unsigned int n);
+static unsigned char *make_text (unsigned int n, int skew, uint64_t *seed);
+static unsigned char *make_bwt (const unsigned char *text, unsigned int n, unsigned int *last);
+static char *write_bwt (const unsigned char *bwt, unsigned int n, unsigned int last);
+static char *temp_file (void);
+static void report (bench_row row, char *step, double *latency, int samples, double ops, double total);
+static uint64_t next_random (uint64_t *state);
+static double now (void);
+static int compare_double (const void *a, const void *b);
+
+
+/*********************************
+ **        GLOBAL VARIABLES     **
+ *********************************/
+static char *skew_names[NUM_SKEWS] = {"uniform", "zipf", "repeat"};
+static char *format_names[NUM_FORMATS] = {"checkpoint", "rankdir", "runlength", "wavelet", "interleaved"};
+
+
+/**********************************
+ **            MAIN              **
+ **********************************/
+int main (int argc, char *argv[])
+{
+   int format = -1;        // -1: all of them
+   int size_mb = 0;        // 0: every BENCH_SIZES
+   int threads = 1;
+   char *real_bwt = NULL;
+   int opts = 1;
+   while (opts + 1 < argc && argv[opts][0] == '-') {
+      if (strcmp(argv[opts],"-f") == 0) {
+         for (format = 0; format < NUM_FORMATS; format++) {
+            if (strcmp(argv[opts + 1],format_names[format]) == 0) break;
+         }
+         if (format == NUM_FORMATS) exit(-1);
+      }
+      else if (strcmp(argv[opts],"-s") == 0) size_mb = atoi(argv[opts + 1]);
+      else if (strcmp(argv[opts],"-j") == 0) threads = atoi(argv[opts + 1]);
+      else if (strcmp(argv[opts],"-r") == 0) real_bwt = argv[opts + 1];
+      else exit(-1);
+      opts += 2;
+   }
+   if (opts != argc || size_mb < 0 || threads < 1) exit(-1);
+
+   printf("corpus,format,bytes,idx_bytes,step,ops,seconds,mb_per_s,ops_per_s,p50_us,p90_us,p99_us,max_us\n");
+   if (real_bwt != NULL) {
+      char *corpus = strrchr(real_bwt,'/');
+      corpus = (corpus == NULL) ? real_bwt : corpus + 1;
+      bench_file(corpus,real_bwt,NULL,format,threads);
+      return 0;
+   }
+   if (size_mb > 0) {
+      bench_synthetic(size_mb,format,threads);
+      return 0;
+   }
+   int sizes[] = BENCH_SIZES;
+   int i;
+   for (i = 0; i < (int) (sizeof(sizes) / sizeof(int)); i++) bench_synthetic(sizes[i],format,threads);
+   return 0;
+}
+
+
+ /**********************************
+ **      FUNCTION DEFINITIONS     **
+ **********************************/
+
+/*
+   Build a text of every skew at size_mb MB, its BWT, and time it.
+*/
+static void bench_synthetic (int size_mb, int format, int threads) {
+   unsigned int n = (unsigned int) size_mb << 20;
+   int skew;
+   for (skew = 0; skew < NUM_SKEWS; skew++) {
+      uint64_t seed = BENCH_SEED + skew;
+      unsigned int last = 0;
+      unsigned char *text = make_text(n,skew,&seed);
+      unsigned char *bwt = make_bwt(text,n,&last);
+      char *bwt_path = write_bwt(bwt,n,last);
+      free(bwt);
+      char corpus[64];
+      snprintf(corpus,sizeof(corpus),"%s-%dMB",skew_names[skew],size_mb);
+      bench_file(corpus,bwt_path,text,format,threads);
+      unlink(bwt_path);
+      free(bwt_path);
+      free(text);
+   }
+}
+
+/*
+   Time every step on one BWT file in the index formats asked for.
+   @params: *text is what the BWT was built from, NULL for a real file
+*/
+static void bench_file (char *corpus, char *bwt_path, const unsigned char *text, int format, int threads) {
+   int f;
+   for (f = 0; f < NUM_FORMATS; f++) {
+      if (format != -1 && format != f) continue;
+      struct _bench_row row;
+      row.corpus = corpus;
+      row.format = format_names[f];
+      row.bytes = 0;
+      row.idx_bytes = 0;
+      bench_format(&row,bwt_path,text,f,threads);
+   }
+}
+
+static void bench_format (bench_row row, char *bwt_path, const unsigned char *text, int format, int threads) {
+   // never next to a real BWT, where they could overwrite its index
+   char *idx_path = temp_file();
+   char *out_path = temp_file();
+   FILE *bwt = fopen(bwt_path,"r");
+   if (bwt == NULL) exit(-1);
+   struct stat sb;
+   if (fstat(fileno(bwt),&sb) == -1 || sb.st_size < BWT_OFFSET) exit(-1);
+   row->bytes = sb.st_size - BWT_OFFSET;
+
+   if (!build(row,idx_path,bwt,format,threads)) exit(-1);
+   FILE *idx = fopen(idx_path,"r");
+   if (idx == NULL) exit(-1);
+   table st = new_symbol_table();
+   if (!load_index(st,bwt,idx)) exit(-1);
+   row->idx_bytes = st->idx_size;
+
+   unsigned char *decoded = time_unbwt(row,st,out_path);
+   if (text != NULL && memcmp(decoded,text,row->bytes) != 0) {
+      fprintf(stderr,"%s: unbwt does not give back the text\n",row->corpus);
+      exit(-1);
+   }
+   time_occ(row,st,decoded);
+   char **patterns = sample_patterns(decoded,row->bytes);
+   time_search(row,st,patterns);
+
+   int i;
+   for (i = 0; i < NUM_PATTERNS; i++) free(patterns[i]);
+   free(patterns);
+   free(decoded);
+   unload_index(st);
+   free(st);
+   fclose(idx);
+   fclose(bwt);
+   unlink(idx_path);
+   unlink(out_path);
+   free(idx_path);
+   free(out_path);
+}
+
+/*
+   Time BUILD_RUNS builds of the index, leaving the last one in idx_path.
+   @return: FALSE if a build failed
+*/
+static int build (bench_row row, char *idx_path, FILE *bwt, int format, int threads) {
+   double latency[BUILD_RUNS];
+   double start = now();
+   int i;
+   for (i = 0; i < BUILD_RUNS; i++) {
+      double begin = now();
+      int built;
+      if (format == IDX_RANKDIR) built = create_rank_dir_idx(idx_path,bwt);
+      else if (format == IDX_RUNLENGTH) built = create_run_length_idx(idx_path,bwt);
+      else if (format == IDX_WAVELET) built = create_wavelet_idx(idx_path,bwt);
+      else if (format == IDX_INTERLEAVED) built = create_interleaved_idx(idx_path,bwt);
+      else built = create_idx(idx_path,bwt,threads);
+      if (!built) return FALSE;
+      latency[i] = now() - begin;
+   }
+   struct stat sb;
+   if (stat(idx_path,&sb) == 0) row->idx_bytes = sb.st_size;
+   report(row,"create_idx",latency,BUILD_RUNS,BUILD_RUNS,now() - start);
+   return TRUE;
+}
+
+/*
+   Time UNBWT_RUNS inversions into out_path.
+   @return: the text, read back from out_path
+*/
+static unsigned char *time_unbwt (bench_row row, table st, char *out_path) {
+   double latency[UNBWT_RUNS];
+   double start = now();
+   int i;
+   for (i = 0; i < UNBWT_RUNS; i++) {
+      int fd = open(out_path,O_RDWR | O_CREAT | O_TRUNC,0644);
+      if (fd == -1) exit(-1);
+      double begin = now();
+      if (!unbwt_blocked(st,fd,(size_t) UNBWT_MEM_BUDGET << 20)) exit(-1);
+      latency[i] = now() - begin;
+      close(fd);
+   }
+   report(row,"unbwt",latency,UNBWT_RUNS,UNBWT_RUNS,now() - start);
+
+   unsigned char *text = malloc(row->bytes + 1);
+   int fd = open(out_path,O_RDONLY);
+   if (fd == -1 || read(fd,text,row->bytes) != (ssize_t) row->bytes) exit(-1);
+   close(fd);
+   return text;
+}
+
+/*
+   Time occ() at OCC_QUERIES random positions, for characters drawn
+   from the text so they follow its skew.
+*/
+static void time_occ (bench_row row, table st, const unsigned char *text) {
+   int batches = OCC_QUERIES / OCC_BATCH;
+   double *latency = malloc(sizeof(double) * batches);
+   int *chars = malloc(sizeof(int) * OCC_BATCH);
+   int *positions = malloc(sizeof(int) * OCC_BATCH);
+   uint64_t seed = BENCH_SEED;
+   volatile unsigned int sink = 0;
+   double total = 0;
+   int b, i;
+   for (b = 0; b < batches; b++) {
+      for (i = 0; i < OCC_BATCH; i++) {
+         chars[i] = text[next_random(&seed) % row->bytes];
+         positions[i] = next_random(&seed) % row->bytes;
+      }
+      double begin = now();
+      for (i = 0; i < OCC_BATCH; i++) sink += occ(chars[i],positions[i],st);
+      double took = now() - begin;
+      latency[b] = took / OCC_BATCH;
+      total += took;
+   }
+   report(row,"occ",latency,batches,OCC_QUERIES,total);
+   free(latency);
+   free(chars);
+   free(positions);
+}
+
+/*
+   Time get_first_and_last(), then backwards_results() and
+   forward_results() on the patterns that match.
+*/
+static void time_search (bench_row row, table st, char **patterns) {
+   double *range_latency = malloc(sizeof(double) * NUM_PATTERNS);
+   double *back_latency = malloc(sizeof(double) * NUM_PATTERNS);
+   double *forward_latency = malloc(sizeof(double) * NUM_PATTERNS);
+   double range_total = 0;
+   double back_total = 0;
+   double forward_total = 0;
+   int found = 0;
+   int i;
+   for (i = 0; i < NUM_PATTERNS; i++) {
+      int fnl[2];
+      double begin = now();
+      get_first_and_last(patterns[i],st,fnl);
+      range_latency[i] = now() - begin;
+      range_total += range_latency[i];
+      if (fnl[LAST] < fnl[FIRST]) continue;
+
+      arena results = new_arena();
+      begin = now();
+      result head = backwards_results(fnl,fnl,st,results);
+      double middle = now();
+      forward_results(fnl,head,st,results);
+      back_latency[found] = middle - begin;
+      forward_latency[found] = now() - middle;
+      back_total += back_latency[found];
+      forward_total += forward_latency[found];
+      found++;
+      free_arena(results);
+   }
+   report(row,"get_first_and_last",range_latency,NUM_PATTERNS,NUM_PATTERNS,range_total);
+   report(row,"backwards_results",back_latency,found,found,back_total);
+   report(row,"forward_results",forward_latency,found,found,forward_total);
+   free(range_latency);
+   free(back_latency);
+   free(forward_latency);
+}
+
+/*
+   NUM_PATTERNS substrings of the text without a newline, so each one
+   matches at least once.
+*/
+static char **sample_patterns (const unsigned char *text, unsigned int n) {
+   char **patterns = malloc(sizeof(char *) * NUM_PATTERNS);
+   uint64_t seed = BENCH_SEED;
+   int i = 0;
+   while (i < NUM_PATTERNS) {
+      unsigned int len = MIN_PATTERN_LEN + next_random(&seed) % (MAX_PATTERN_LEN - MIN_PATTERN_LEN + 1);
+      if (len > n) len = n;
+      unsigned int start = next_random(&seed) % (n - len + 1);
+      if (memchr(text + start,'\n',len) != NULL || memchr(text + start,'\0',len) != NULL) continue;
+      patterns[i] = malloc(len + 1);
+      memcpy(patterns[i],text + start,len);
+      patterns[i][len] = '\0';
+      i++;
+   }
+   return patterns;
+}
+
+/*
+   n bytes of lines of MIN_LINE to MAX_LINE characters in the given skew.
+   The last byte is a newline.
+*/
+static unsigned char *make_text (unsigned int n, int skew, uint64_t *seed) {
+   unsigned char *text = malloc(n);
+   unsigned int zipf[ZIPF_SYMBOLS];
+   unsigned int i, k;
+   double sum = 0;
+   double acc = 0;
+   // cumulative 1/k weights, scaled to 2^32
+   for (k = 0; k < ZIPF_SYMBOLS; k++) sum += 1.0 / (k + 1);
+   for (k = 0; k < ZIPF_SYMBOLS; k++) {
+      acc += 1.0 / (k + 1);
+      zipf[k] = (unsigned int) (acc / sum * 0xFFFFFFFFu);
+   }
+   unsigned int line_left = 0;
+   for (i = 0; i < n; i++) {
+      if (skew == SKEW_REPEAT && i >= REPEAT_BLOCK && next_random(seed) % REPEAT_CHANGE != 0) {
+         text[i] = text[i - REPEAT_BLOCK];
+         continue;
+      }
+      if (line_left == 0) {
+         text[i] = '\n';
+         line_left = MIN_LINE + next_random(seed) % (MAX_LINE - MIN_LINE + 1);
+         continue;
+      }
+      line_left--;
+      uint64_t r = next_random(seed);
+      if (skew == SKEW_ZIPF) {
+         unsigned int u = (unsigned int) r;
+         for (k = 0; k < ZIPF_SYMBOLS - 1 && zipf[k] < u; k++);
+         text[i] = '!' + k;
+      }
+      else {
+         text[i] = (r % 27 == 26) ? ' ' : 'a' + r % 27;
+      }
+   }
+   text[n - 1] = '\n';
+   return text;
+}
+
+/*
+   BWT of the text read as a cycle, by prefix doubling: rotations are
+   sorted by their first 2^h characters with two counting sorts a round.
+   @return: the BWT, with the row of the rotation starting at offset 0
+            in *last
+*/
+static unsigned char *make_bwt (const unsigned char *text, unsigned int n, unsigned int *last) {
+   unsigned int *p = malloc(sizeof(int) * n);
+   unsigned int *c = malloc(sizeof(int) * n);
+   unsigned int *pn = malloc(sizeof(int) * n);
+   unsigned int *cn = malloc(sizeof(int) * n);
+   unsigned int *count = calloc((n > MAX_CHARS) ? n : MAX_CHARS,sizeof(int));
+   unsigned int i, h, classes;
+
+   for (i = 0; i < n; i++) count[text[i]]++;
+   for (i = 1; i < MAX_CHARS; i++) count[i] += count[i - 1];
+   for (i = n; i-- > 0;) p[--count[text[i]]] = i;
+   c[p[0]] = 0;
+   classes = 1;
+   for (i = 1; i < n; i++) {
+      if (text[p[i]] != text[p[i - 1]]) classes++;
+      c[p[i]] = classes - 1;
+   }
+   for (h = 1; h < n && classes < n; h *= 2) {
+      // already sorted by the second half, sort stably by the first
+      for (i = 0; i < n; i++) pn[i] = (p[i] + n - h) % n;
+      memset(count,0,sizeof(int) * classes);
+      for (i = 0; i < n; i++) count[c[pn[i]]]++;
+      for (i = 1; i < classes; i++) count[i] += count[i - 1];
+      for (i = n; i-- > 0;) p[--count[c[pn[i]]]] = pn[i];
+      cn[p[0]] = 0;
+      classes = 1;
+      for (i = 1; i < n; i++) {
+         if (c[p[i]] != c[p[i - 1]] || c[(p[i] + h) % n] != c[(p[i - 1] + h) % n]) classes++;
+         cn[p[i]] = classes - 1;
+      }
+      unsigned int *swap = c;
+      c = cn;
+      cn = swap;
+   }
+
+   unsigned char *bwt = malloc(n);
+   for (i = 0; i < n; i++) {
+      bwt[i] = text[(p[i] + n - 1) % n];
+      if (p[i] == 0) *last = i;
+   }
+   free(p);
+   free(c);
+   free(pn);
+   free(cn);
+   free(count);
+   return bwt;
+}
+
+/*
+   Write a BWT file ([last][BWT]) to a new temporary file.
+   @return: its path, which the caller frees
+*/
+static char *write_bwt (const unsigned char *bwt, unsigned int n, unsigned int last) {
+   char *path = temp_file();
+   int fd = open(path,O_WRONLY);
+   if (fd == -1) exit(-1);
+   if (write(fd,&last,sizeof(last)) != sizeof(last) || write(fd,bwt,n) != (ssize_t) n) exit(-1);
+   close(fd);
+   return path;
+}
+
+/*
+   Create an empty file in $TMPDIR (or /tmp).
+   @return: its path, which the caller frees
+*/
+static char *temp_file (void) {
+   char *dir = getenv("TMPDIR");
+   if (dir == NULL) dir = "/tmp";
+   size_t len = strlen(dir) + 32;
+   char *path = malloc(len);
+   snprintf(path,len,"%s/bwtbenchXXXXXX",dir);
+   int fd = mkstemp(path);
+   if (fd == -1) exit(-1);
+   close(fd);
+   return path;
+}
+
+/*
+   Print one CSV row. latency[] holds samples seconds per operation.
+*/
+static void report (bench_row row, char *step, double *latency, int samples, double ops, double total) {
+   double mb = (strcmp(step,"create_idx") == 0 || strcmp(step,"unbwt") == 0)
+             ? (double) row->bytes * ops / (1 << 20) : 0;
+   printf("%s,%s,%u,%u,%s,%.0f,%.6f,%.2f,%.1f",row->corpus,row->format,row->bytes,row->idx_bytes,step,ops,total,
+          (total > 0) ? mb / total : 0,(total > 0) ? ops / total : 0);
+   if (samples == 0) {
+      printf(",,,,\n");
+      return;
+   }
+   qsort(latency,samples,sizeof(double),compare_double);
+   printf(",%.3f,%.3f,%.3f,%.3f\n",
+          latency[samples / 2] * 1e6,
+          latency[(int) (samples * 0.90)] * 1e6,
+          latency[(int) (samples * 0.99)] * 1e6,
+          latency[samples - 1] * 1e6);
+}
+
+// xorshift64*, so every run sees the same corpora and queries
+static uint64_t next_random (uint64_t *state) {
+   uint64_t x = *state;
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   *state = x;
+   return x * 2685821657736338717ULL;
+}
+
+static double now (void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double (const void *a, const void *b) {
+   double x = *(const double *) a;
+   double y = *(const double *) b;
+   return (x > y) - (x < y);
+}
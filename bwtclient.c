@@ -0,0 +1,311 @@
+/***********************************************************************
+************************************************************************
+***                                                                  ***
+***   Filename:  bwtclient.c                                         ***
+***   Purpose:   Client and latency benchmark for the query server   ***
+***              (hearchtbw -S <socket>)                             ***
+***                                                                  ***
+************************************************************************
+***********************************************************************/
+
+/*
+   Usage:
+      bwtclient <socket> <c|l|o|x> <pattern>
+         send one count, line, locate or extract query and print the
+         answer (the pattern of x is <offset>:<length>)
+      bwtclient -B <socket> <c|l|o|x> <patterns> <clients>
+         send every line of <patterns> from <clients> concurrent
+         connections and report the latency of each request
+      bwtclient -P <hearchtbw> <bwt> <index> <patterns>
+         the same report for one hearchtbw process per pattern, which is
+         what every query costs without the server
+*/
+
+
+/*********************************
+ **          #INCLUDES          **
+ *********************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "bwtproto.h"
+
+
+/*********************************
+ **          #DEFINES           **
+ *********************************/
+
+// COMMAND LINE ARGUMENTS
+#define SOCKET_ARG 1
+#define COMMAND_ARG 2
+#define PATTERN_ARG 3
+#define QUERY_MODE 4
+
+#define BENCH_SOCKET_ARG 2
+#define BENCH_COMMAND_ARG 3
+#define BENCH_PATTERNS_ARG 4
+#define BENCH_CLIENTS_ARG 5
+#define BENCH_MODE 6
+
+#define PROC_BINARY_ARG 2
+#define PROC_BWT_ARG 3
+#define PROC_INDEX_ARG 4
+#define PROC_PATTERNS_ARG 5
+#define PROC_MODE 6
+
+
+/*********************************
+ **        TYPE DEFINES         **
+ *********************************/
+
+/*
+   One benchmark connection: sends patterns first, first + step, ...
+   and records the latency of each in latency[]
+*/
+typedef struct _bench_client *bench_client;
+struct _bench_client {
+   char *socket_path;
+   char command;
+   char **patterns;
+   int num_patterns;
+   int first;
+   int step;
+   double *latency;        // seconds, indexed like patterns
+   int failed;             // # requests without a PROTO_OK answer
+} bench_client_object;
+
+
+/*********************************
+ **      FUNCTION PROTOTYPES    **
+ *********************************/
+static int connect_to (char *socket_path);
+static int query (int fd, char command, char *pattern, char **answer, uint32_t *len);
+static void *run_bench_client (void *arg);
+static void bench_server (char *socket_path, char command, char *patterns_file, int clients);
+static void bench_processes (char *binary, char *bwt, char *index, char *patterns_file);
+static char **read_patterns (char *patterns_file, int *num_patterns);
+static void report (char *what, double *latency, int count, double wall);
+static double now (void);
+static int compare_double (const void *a, const void *b);
+
+
+/**********************************
+ **            MAIN              **
+ **********************************/
+int main (int argc, char *argv[])
+{
+   if (argc == BENCH_MODE && strcmp(argv[1],"-B") == 0) {
+      bench_server(argv[BENCH_SOCKET_ARG],argv[BENCH_COMMAND_ARG][0],
+                   argv[BENCH_PATTERNS_ARG],atoi(argv[BENCH_CLIENTS_ARG]));
+   }
+   else if (argc == PROC_MODE && strcmp(argv[1],"-P") == 0) {
+      bench_processes(argv[PROC_BINARY_ARG],argv[PROC_BWT_ARG],
+                      argv[PROC_INDEX_ARG],argv[PROC_PATTERNS_ARG]);
+   }
+   else if (argc == QUERY_MODE) {
+      int fd = connect_to(argv[SOCKET_ARG]);
+      char *answer;
+      uint32_t len;
+      if (!query(fd,argv[COMMAND_ARG][0],argv[PATTERN_ARG],&answer,&len)) exit(-1);
+      fwrite(answer + 1,1,len - 1,stdout);
+      int status = answer[0];
+      free(answer);
+      close(fd);
+      return (status == PROTO_OK) ? 0 : 1;
+   }
+   else {
+      exit(-1);
+   }
+   return 0;
+}
+
+
+ /**********************************
+ **      FUNCTION DEFINITIONS     **
+ **********************************/
+
+static int connect_to (char *socket_path) {
+   struct sockaddr_un addr;
+   int fd = socket(AF_UNIX,SOCK_STREAM,0);
+   if (fd == -1) exit(-1);
+   memset(&addr,0,sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(socket_path) >= sizeof(addr.sun_path)) exit(-1);
+   strcpy(addr.sun_path,socket_path);
+   if (connect(fd,(struct sockaddr *) &addr,sizeof(addr)) == -1) exit(-1);
+   return fd;
+}
+
+/*
+   Send one request and wait for its answer ([status][body]).
+   @return: TRUE, or FALSE if the connection failed
+*/
+static int query (int fd, char command, char *pattern, char **answer, uint32_t *len) {
+   if (!send_frame(fd,&command,1,pattern,strlen(pattern))) return FALSE;
+   if (!recv_frame(fd,answer,len,UINT32_MAX - 1)) return FALSE;
+   if (*len < 1) {
+      free(*answer);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+static void *run_bench_client (void *arg) {
+   bench_client bc = arg;
+   int fd = connect_to(bc->socket_path);
+   int i;
+   for (i = bc->first; i < bc->num_patterns; i += bc->step) {
+      char *answer;
+      uint32_t len;
+      double start = now();
+      if (!query(fd,bc->command,bc->patterns[i],&answer,&len)) {
+         bc->failed += (bc->num_patterns - i + bc->step - 1) / bc->step;
+         break;
+      }
+      bc->latency[i] = now() - start;
+      if (answer[0] != PROTO_OK) bc->failed++;
+      free(answer);
+   }
+   close(fd);
+   return NULL;
+}
+
+/*
+   Spread the patterns over clients connections, pattern i going to
+   connection i % clients, and report the latencies.
+*/
+static void bench_server (char *socket_path, char command, char *patterns_file, int clients) {
+   int num_patterns;
+   char **patterns = read_patterns(patterns_file,&num_patterns);
+   double *latency = calloc(num_patterns + 1,sizeof(double));
+   if (clients < 1) clients = 1;
+   pthread_t *threads = malloc(sizeof(pthread_t) * clients);
+   bench_client bcs = calloc(clients,sizeof(bench_client_object));
+   int i;
+   int failed = 0;
+
+   double start = now();
+   for (i = 0; i < clients; i++) {
+      bcs[i].socket_path = socket_path;
+      bcs[i].command = command;
+      bcs[i].patterns = patterns;
+      bcs[i].num_patterns = num_patterns;
+      bcs[i].first = i;
+      bcs[i].step = clients;
+      bcs[i].latency = latency;
+      pthread_create(&threads[i],NULL,run_bench_client,&bcs[i]);
+   }
+   for (i = 0; i < clients; i++) {
+      pthread_join(threads[i],NULL);
+      failed += bcs[i].failed;
+   }
+   double wall = now() - start;
+
+   report("server",latency,num_patterns,wall);
+   if (failed > 0) printf("failed requests = %d\n",failed);
+
+   for (i = 0; i < num_patterns; i++) free(patterns[i]);
+   free(patterns);
+   free(latency);
+   free(threads);
+   free(bcs);
+}
+
+/*
+   Run hearchtbw once per pattern, output thrown away, and report.
+*/
+static void bench_processes (char *binary, char *bwt, char *index, char *patterns_file) {
+   int num_patterns;
+   char **patterns = read_patterns(patterns_file,&num_patterns);
+   double *latency = calloc(num_patterns + 1,sizeof(double));
+   int i;
+
+   double start = now();
+   for (i = 0; i < num_patterns; i++) {
+      double begin = now();
+      pid_t pid = fork();
+      if (pid == -1) exit(-1);
+      if (pid == 0) {
+         int null_fd = open("/dev/null",O_WRONLY);
+         dup2(null_fd,STDOUT_FILENO);
+         execl(binary,binary,bwt,index,patterns[i],(char *) NULL);
+         _exit(127);
+      }
+      waitpid(pid,NULL,0);
+      latency[i] = now() - begin;
+   }
+   double wall = now() - start;
+
+   report("process",latency,num_patterns,wall);
+
+   for (i = 0; i < num_patterns; i++) free(patterns[i]);
+   free(patterns);
+   free(latency);
+}
+
+/*
+   Read the non empty lines of a file.
+*/
+static char **read_patterns (char *patterns_file, int *num_patterns) {
+   FILE *f = fopen(patterns_file,"r");
+   if (f == NULL) exit(-1);
+   int cap = 64;
+   char **patterns = malloc(sizeof(char *) * cap);
+   char *line = NULL;
+   size_t line_cap = 0;
+   ssize_t len;
+   *num_patterns = 0;
+   while ((len = getline(&line,&line_cap,f)) != -1) {
+      if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+      if (len == 0) continue;
+      if (*num_patterns == cap) {
+         cap *= 2;
+         patterns = realloc(patterns,sizeof(char *) * cap);
+      }
+      patterns[(*num_patterns)++] = strdup(line);
+   }
+   free(line);
+   fclose(f);
+   return patterns;
+}
+
+/*
+   Print request count, throughput and latency percentiles.
+*/
+static void report (char *what, double *latency, int count, double wall) {
+   if (count == 0) {
+      printf("%s: no patterns\n",what);
+      return;
+   }
+   qsort(latency,count,sizeof(double),compare_double);
+   printf("%s: requests = %d, wall = %.3f s, throughput = %.1f req/s\n",
+          what,count,wall,count / wall);
+   printf("%s: p50 = %.3f ms, p90 = %.3f ms, p99 = %.3f ms, max = %.3f ms\n",what,
+          latency[count / 2] * 1000,
+          latency[(int) (count * 0.90)] * 1000,
+          latency[(int) (count * 0.99)] * 1000,
+          latency[count - 1] * 1000);
+}
+
+static double now (void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double (const void *a, const void *b) {
+   double x = *(const double *) a;
+   double y = *(const double *) b;
+   return (x > y) - (x < y);
+}
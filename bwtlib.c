@@ -0,0 +1,415 @@
+/***********************************************************************
+************************************************************************
+***                                                                  ***
+***   Filename:  bwtlib.c                                            ***
+***   Purpose:   Library interface to a BWT file and its index       ***
+***              (see bwtlib.h)                                      ***
+***                                                                  ***
+************************************************************************
+***********************************************************************/
+
+
+/*********************************
+ **          #INCLUDES          **
+ *********************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "bwt.h"
+#include "bwtlib.h"
+
+
+/*********************************
+ **          #DEFINES           **
+ *********************************/
+
+// "x" of a macro's value, for messages that quote a limit
+#define STRING_OF(x) #x
+#define VALUE_STRING(x) STRING_OF(x)
+
+
+/*********************************
+ **        TYPE DEFINES         **
+ *********************************/
+
+/*
+   An open BWT: the loaded symbol table and the files it maps
+*/
+struct _bwt_index {
+   table st;
+   FILE *bwt;
+   FILE *idx;
+};
+
+/*
+   State shared by the threads of a parallel unbwt. The text is cut into
+   tasks of chunks_per_task inverse suffix array chunks.
+*/
+typedef struct _unbwt_object *unbwt_job;
+struct _unbwt_object {
+   table st;
+   int fd;                       // output file
+   unsigned int chunks_per_task;
+   unsigned int num_tasks;
+   unsigned int next_task;       // next task to hand out (atomic)
+   int failed;                   // a write failed
+} unbwt_object;
+
+
+/*********************************
+ **      FUNCTION PROTOTYPES    **
+ *********************************/
+
+static int build_index (const char *idx_path, FILE *bwt, const bwt_options *opts);
+static int unbwt_blocked (table st, int fd, size_t budget);
+static int parallel_unbwt (table st, int fd, int threads);
+static void *run_unbwt_worker (void *arg);
+
+
+/*********************************
+ **        GLOBAL VARIABLES     **
+ *********************************/
+
+static __thread struct _query_stats thread_stats;  // what bwt_start_stats() counts into
+static __thread double stats_started;
+
+
+ /**********************************
+ **      FUNCTION DEFINITIONS     **
+ **********************************/
+
+void bwt_default_options (bwt_options *opts) {
+   opts->format = BWT_FORMAT_CHECKPOINT;
+   opts->threads = 0;
+   opts->sa_rate = 0;
+   opts->isa_rate = 0;
+}
+
+/*
+   Open the BWT at bwt_path with its index at idx_path. An index that is
+   missing, stale or of another BWT is (re)built first, and the samples
+   opts asks for are added to it when it has none.
+   @params: *opts may be NULL for bwt_default_options()
+   @return: BWT_OK with the handle in *ix, or the error
+*/
+int bwt_open (const char *bwt_path, const char *idx_path, const bwt_options *opts, bwt_index *ix) {
+   bwt_options defaults;
+   if (opts == NULL) {
+      bwt_default_options(&defaults);
+      opts = &defaults;
+   }
+   *ix = NULL;
+   FILE *bwt = fopen(bwt_path,"r");
+   if (bwt == NULL) return BWT_ERR_OPEN;
+   // rows are int: a bigger BWT would be searched wrong, not slowly
+   struct stat bwt_stat;
+   if (fstat(fileno(bwt),&bwt_stat) != 0 || !bwt_size_fits(bwt_stat.st_size)) {
+      fclose(bwt);
+      return BWT_ERR_OPEN;
+   }
+   FILE *idx = fopen(idx_path,"r");
+   // an index of another BWT or an older layout is rebuilt
+   if (idx != NULL && !index_is_current(bwt,idx)) {
+      fclose(idx);
+      idx = NULL;
+   }
+   if (idx == NULL) {
+      if (!build_index(idx_path,bwt,opts) || (idx = fopen(idx_path,"r")) == NULL) {
+         fclose(bwt);
+         return BWT_ERR_INDEX;
+      }
+   }
+
+   // map both files, everything from here on works on pointers
+   table st = new_symbol_table();
+   int loaded = load_index(st,bwt,idx);
+   // locate and extract need samples, add them to the index once
+   unsigned int add_sa = (loaded && st->sa == NULL) ? opts->sa_rate : 0;
+   unsigned int add_isa = (loaded && st->isa == NULL) ? opts->isa_rate : 0;
+   if (add_sa > 0 || add_isa > 0) {
+      loaded = add_samples(idx_path,st,add_sa,add_isa);
+      unload_index(st);
+      loaded = loaded && load_index(st,bwt,idx);
+   }
+   if (!loaded) {
+      free(st);
+      fclose(bwt);
+      fclose(idx);
+      return BWT_ERR_INDEX;
+   }
+
+   *ix = malloc(sizeof(struct _bwt_index));
+   (*ix)->st = st;
+   (*ix)->bwt = bwt;
+   (*ix)->idx = idx;
+   return BWT_OK;
+}
+
+static int build_index (const char *idx_path, FILE *bwt, const bwt_options *opts) {
+   if (opts->format == BWT_FORMAT_RANKDIR) return create_rank_dir_idx(idx_path,bwt);
+   if (opts->format == BWT_FORMAT_RUNLENGTH) return create_run_length_idx(idx_path,bwt);
+   if (opts->format == BWT_FORMAT_WAVELET) return create_wavelet_idx(idx_path,bwt);
+   if (opts->format == BWT_FORMAT_INTERLEAVED) return create_interleaved_idx(idx_path,bwt);
+   int threads = (opts->threads > 0) ? opts->threads : sysconf(_SC_NPROCESSORS_ONLN);
+   return create_idx(idx_path,bwt,threads);
+}
+
+void bwt_close (bwt_index ix) {
+   if (ix == NULL) return;
+   unload_index(ix->st);
+   free(ix->st);
+   fclose(ix->bwt);
+   fclose(ix->idx);
+   free(ix);
+}
+
+int bwt_get_stats (bwt_index ix, bwt_stats *stats) {
+   table st = ix->st;
+   stats->bwt_size = st->bwt_size;
+   stats->idx_size = st->idx_size;
+   stats->format = st->idx_format;
+   stats->sa_rate = (st->sa != NULL) ? st->sa->rate : 0;
+   stats->isa_rate = (st->isa != NULL) ? st->isa->rate : 0;
+   return BWT_OK;
+}
+
+const char *bwt_strerror (int err) {
+   switch (err) {
+      case BWT_OK:               return "no error";
+      case BWT_ERR_OPEN:         return "cannot open the BWT file, or it is over 2 GB";
+      case BWT_ERR_INDEX:        return "cannot build or read the index";
+      case BWT_ERR_PATTERN:      return "empty pattern";
+      case BWT_ERR_NO_SAMPLES:   return "index has no samples for this query";
+      case BWT_ERR_RANGE:        return "negative length";
+      case BWT_ERR_WRITE:        return "cannot write the output file";
+      case BWT_ERR_ERRORS:       return "error bound must be at most " VALUE_STRING(BWT_MAX_ERRORS)
+                                        " and below half the pattern length";
+      default:                   return "unknown error";
+   }
+}
+
+int bwt_count (bwt_index ix, const char *pattern) {
+   if (pattern[0] == '\0') return BWT_ERR_PATTERN;
+   return count_matches((char *) pattern,ix->st);
+}
+
+/*
+   Hand every line holding pattern to fn, in the order the command line
+   prints them. The lines are rebuilt on threads threads; max_lines > 0
+   rebuilds only the first max_lines of them.
+   @return: # matches of pattern
+*/
+int bwt_search (bwt_index ix, const char *pattern, int threads, int max_lines, bwt_line_fn fn, void *arg) {
+   if (pattern[0] == '\0') return BWT_ERR_PATTERN;
+   return search_lines((char *) pattern,ix->st,threads,max_lines,fn,arg);
+}
+
+/*
+   Hand every line holding a string within max_errors (BWT_MISMATCHES or
+   BWT_EDITS, by mode) of pattern to fn once, with the fewest errors of
+   its matches. Lines with fewer errors come first, in the order 
+   bwt_search() gives among the same errors. threads and max_lines are
+   as in bwt_search(). max_errors runs from 0 to BWT_MAX_ERRORS and 
+   must be below half the length of pattern, the search time grows 
+   quickly with it.
+   @return: # text positions a match ends on
+*/
+int bwt_search_approx (bwt_index ix, const char *pattern, int max_errors, int mode, int threads, int max_lines, bwt_approx_line_fn fn, void *arg) {
+   if (pattern[0] == '\0') return BWT_ERR_PATTERN;
+   if (max_errors < 0 || max_errors > BWT_MAX_ERRORS || 2 * max_errors >= (int) strlen(pattern)) {
+      return BWT_ERR_ERRORS;
+   }
+   return search_approx_lines((char *) pattern,ix->st,max_errors,mode == BWT_EDITS,threads,max_lines,fn,arg);
+}
+
+// Only what bwt_search_approx() returns, no lines are rebuilt
+int bwt_count_approx (bwt_index ix, const char *pattern, int max_errors, int mode) {
+   return bwt_search_approx(ix,pattern,max_errors,mode,1,0,NULL,NULL);
+}
+
+/*
+   @return: # matches of pattern, their text offsets in order in
+            *offsets, which the caller frees
+*/
+int bwt_locate (bwt_index ix, const char *pattern, unsigned int **offsets) {
+   *offsets = NULL;
+   if (pattern[0] == '\0') return BWT_ERR_PATTERN;
+   if (ix->st->sa == NULL) return BWT_ERR_NO_SAMPLES;
+   return locate_matches((char *) pattern,ix->st,offsets);
+}
+
+/*
+   Copy text[offset, offset + length) into out, cut at the end of the
+   text. Without inverse suffix array samples this walks from the end of
+   the text.
+   @return: # bytes copied
+*/
+int bwt_extract (bwt_index ix, unsigned int offset, int length, char *out) {
+   if (length < 0) return BWT_ERR_RANGE;
+   return extract(ix->st,offset,length,out);
+}
+
+/*
+   Rebuild the text into output. With threads > 1 and inverse suffix
+   array samples the threads decode separate chunks. Otherwise the text
+   is decoded backwards from row st->last into one buffer when the text
+   fits in mem_budget bytes (0 for UNBWT_MEM_BUDGET MB), or else block
+   by block.
+*/
+int bwt_unbwt (bwt_index ix, const char *output, int threads, size_t mem_budget) {
+   table st = ix->st;
+   if (mem_budget == 0) mem_budget = (size_t) UNBWT_MEM_BUDGET << 20;
+   int fd = open(output,O_RDWR | O_CREAT | O_TRUNC,0644);
+   if (fd == -1) return BWT_ERR_WRITE;
+   int written;
+   if (threads > 1 && st->isa != NULL) written = parallel_unbwt(st,fd,threads);
+   else written = unbwt_blocked(st,fd,mem_budget);
+   if (close(fd) != 0) written = FALSE;
+   return written ? BWT_OK : BWT_ERR_WRITE;
+}
+
+/*
+   Decode backwards into a buffer of at most budget bytes, writing each
+   full buffer at its place in the file. LF steps use the mapped index
+   rather than an LF[] table: 4 bytes a row misses the cache more often
+   than the BWT and its rank counts do.
+   @return: FALSE if a write failed
+*/
+static int unbwt_blocked (table st, int fd, size_t budget) {
+   size_t n = st->bwt_size;
+   size_t block = (budget < MIN_UNBWT_BLOCK) ? MIN_UNBWT_BLOCK : budget;
+   if (block > n) block = n;
+   if (ftruncate(fd,n) != 0) return FALSE;
+   unsigned char *buf = malloc(block + 1);
+   unsigned int row = st->last;
+   size_t end = n;
+   while (end > 0) {
+      size_t start = (end > block) ? end - block : 0;
+      size_t i;
+      for (i = end; i > start; i--) {
+         int c = bwt_char(st,row);
+         buf[i - 1 - start] = c;
+         row = st->ctable[c] + occ(c,row,st);
+      }
+      if (pwrite(fd,buf,end - start,start) != (ssize_t) (end - start)) {
+         free(buf);
+         return FALSE;
+      }
+      end = start;
+   }
+   free(buf);
+   return TRUE;
+}
+
+/*
+   Decode the text on several threads with the inverse suffix array
+   samples: the row of each sampled offset starts an LF walk backwards
+   through the chunk before it. Threads take tasks of consecutive chunks
+   in turn and write each decoded task straight to its output offset.
+   @return: FALSE if a write failed
+*/
+static int parallel_unbwt (table st, int fd, int threads) {
+   struct _unbwt_object job;
+   unsigned int num_chunks = st->isa->num_samples;
+   int i;
+   job.st = st;
+   job.fd = fd;
+   if (ftruncate(job.fd,st->bwt_size) != 0) return FALSE;
+   job.chunks_per_task = UNBWT_TASK_SIZE / st->isa->rate;
+   if (job.chunks_per_task == 0) job.chunks_per_task = 1;
+   job.num_tasks = (num_chunks + job.chunks_per_task - 1) / job.chunks_per_task;
+   job.next_task = 0;
+   job.failed = FALSE;
+
+   pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+   int started = 0;
+   for (i = 0; i < threads; i++) {
+      if (pthread_create(&workers[i],NULL,run_unbwt_worker,&job) != 0) break;
+      started++;
+   }
+   if (started == 0) run_unbwt_worker(&job);
+   for (i = 0; i < started; i++) pthread_join(workers[i],NULL);
+   free(workers);
+   return !job.failed;
+}
+
+static void *run_unbwt_worker (void *arg) {
+   unbwt_job job = arg;
+   table st = job->st;
+   unsigned int rate = st->isa->rate;
+   unsigned int num_chunks = st->isa->num_samples;
+   unsigned char *buf = malloc((size_t) rate * job->chunks_per_task);
+   unsigned int task;
+   while ((task = __sync_fetch_and_add(&job->next_task,1)) < job->num_tasks) {
+      unsigned int first = task * job->chunks_per_task;
+      unsigned int end_chunk = first + job->chunks_per_task;
+      if (end_chunk > num_chunks) end_chunk = num_chunks;
+      unsigned int start = first * rate;
+      unsigned int end = (end_chunk == num_chunks) ? st->bwt_size : end_chunk * rate;
+      // the chunk after the last one is the start of the (cyclic) text
+      unsigned int row = (end_chunk == num_chunks) ? st->last : st->isa_rows[end_chunk];
+      unsigned int pos;
+      for (pos = end; pos > start; pos--) {
+         int c = bwt_char(st,row);
+         buf[pos - 1 - start] = c;
+         row = st->ctable[c] + occ(c,row,st);
+      }
+      if (pwrite(job->fd,buf,end - start,start) != (ssize_t) (end - start)) job->failed = TRUE;
+   }
+   free(buf);
+   return NULL;
+}
+
+/*
+   Count what the queries of the calling thread cost from here on, the
+   lines they rebuild on other threads included. Counting costs a
+   little on every rank step, so it is off until this is called.
+*/
+void bwt_start_stats (void) {
+   memset(&thread_stats,0,sizeof(thread_stats));
+   counting = &thread_stats;
+   stats_started = stats_clock();
+}
+
+/*
+   Stop counting and hand back what was counted since bwt_start_stats().
+*/
+void bwt_stop_stats (bwt_query_stats *stats) {
+   int p;
+   memset(stats,0,sizeof(bwt_query_stats));
+   if (counting == NULL) return;
+   stats->seconds = stats_clock() - stats_started;
+   stats->rank_calls = thread_stats.rank_calls;
+   stats->select_calls = thread_stats.select_calls;
+   stats->lf_steps = thread_stats.lf_steps;
+   stats->bwt_bytes = thread_stats.bwt_bytes;
+   stats->idx_bytes = thread_stats.idx_bytes;
+   stats->blocks = thread_stats.blocks;
+   for (p = 0; p < BWT_NUM_PHASES; p++) stats->phase_seconds[p] = thread_stats.phase_time[p];
+   counting = NULL;
+}
+
+// Add the counters and times of from to into, for totals over queries
+void bwt_add_stats (bwt_query_stats *into, const bwt_query_stats *from) {
+   int p;
+   into->rank_calls += from->rank_calls;
+   into->select_calls += from->select_calls;
+   into->lf_steps += from->lf_steps;
+   into->bwt_bytes += from->bwt_bytes;
+   into->idx_bytes += from->idx_bytes;
+   into->blocks += from->blocks;
+   for (p = 0; p < BWT_NUM_PHASES; p++) into->phase_seconds[p] += from->phase_seconds[p];
+   into->seconds += from->seconds;
+}
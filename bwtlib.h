@@ -0,0 +1,157 @@
+/***********************************************************************
+************************************************************************
+***                                                                  ***
+***   Filename:  bwtlib.h                                            ***
+***   Purpose:   Library interface to a BWT file and its index       ***
+***                                                                  ***
+************************************************************************
+***********************************************************************/
+
+/*
+   Open a BWT once and run any number of queries against it:
+
+      bwt_index ix;
+      if (bwt_open("text.bwt","text.idx",NULL,&ix) != BWT_OK) ...
+      int matches = bwt_search(ix,"pattern",1,0,print_line,stdout);
+      bwt_close(ix);
+
+   Functions that return a count return it, or a negative BWT_ERR_*.
+   The others return BWT_OK or a BWT_ERR_*. Nothing here exits the
+   process. An open handle is only read, so any number of threads may
+   query it at once.
+*/
+
+#ifndef BWTLIB_H
+#define BWTLIB_H
+
+#include <stddef.h>
+
+
+/*********************************
+ **          #DEFINES           **
+ *********************************/
+
+// STATUS CODES
+#define BWT_OK 0
+#define BWT_ERR_OPEN -1          // the BWT file cannot be opened or mapped, or
+                                 // is over 2 GB (rows are int)
+#define BWT_ERR_INDEX -2         // the index cannot be built, read or updated
+#define BWT_ERR_PATTERN -3       // empty pattern
+#define BWT_ERR_NO_SAMPLES -4    // the index lacks the samples this needs
+#define BWT_ERR_RANGE -5         // negative length
+#define BWT_ERR_WRITE -6         // the output file cannot be written
+#define BWT_ERR_ERRORS -7        // error bound out of range (see BWT_MAX_ERRORS)
+
+// APPROXIMATE MATCHING (bwt_search_approx)
+#define BWT_MISMATCHES 0         // errors are substituted characters
+#define BWT_EDITS 1              // and inserted or deleted ones
+#define BWT_MAX_ERRORS 8         // most errors a search allows; it also has to
+                                 // be below half the pattern length, where
+                                 // nearly every text position would match
+
+// INDEX FORMATS
+#define BWT_FORMAT_CHECKPOINT 0  // count block every 64 to 2048 bytes
+#define BWT_FORMAT_RANKDIR 1     // two-level rank directory
+#define BWT_FORMAT_RUNLENGTH 2   // runs of equal characters, for repetitive text
+#define BWT_FORMAT_WAVELET 3     // wavelet matrix, scan-free rank without the BWT
+#define BWT_FORMAT_INTERLEAVED 4 // checkpoints holding the BWT bytes they cover
+
+// DEFAULT SAMPLE RATES
+#define BWT_SA_SAMPLE_RATE 32       // suffix array samples for locate
+#define BWT_ISA_SAMPLE_RATE 1024    // inverse suffix array samples for extract
+
+// QUERY PHASES (bwt_query_stats.phase_seconds)
+#define BWT_PHASE_INTERVAL 0     // backward search for the matching rows
+#define BWT_PHASE_BACKWARD 1     // rebuilding lines back to their start
+#define BWT_PHASE_FORWARD 2      // rebuilding lines on to their end
+#define BWT_PHASE_DEDUP 3        // dropping lines holding several matches
+#define BWT_PHASE_OUTPUT 4       // handing lines to the callback
+#define BWT_NUM_PHASES 5
+
+
+/*********************************
+ **        TYPE DEFINES         **
+ *********************************/
+
+// An open BWT and index
+typedef struct _bwt_index *bwt_index;
+
+/*
+   How bwt_open() builds or extends the index. Samples are only added
+   to an index that has none of that kind.
+*/
+typedef struct _bwt_options bwt_options;
+struct _bwt_options {
+   int format;             // BWT_FORMAT_* of an index that has to be built
+   int threads;            // # threads to build it on (0 = one per CPU)
+   unsigned int sa_rate;   // add suffix array samples at this rate (0 = no)
+   unsigned int isa_rate;  // add inverse suffix array samples (0 = no)
+};
+
+// What an open index holds
+typedef struct _bwt_stats bwt_stats;
+struct _bwt_stats {
+   unsigned int bwt_size;  // # bytes of text
+   unsigned int idx_size;  // # bytes in the index file
+   int format;             // BWT_FORMAT_*
+   unsigned int sa_rate;   // suffix array sample rate (0 = none)
+   unsigned int isa_rate;  // inverse suffix array sample rate (0 = none)
+};
+
+/*
+   What the queries of one thread cost between bwt_start_stats() and
+   bwt_stop_stats(). Bytes are those the rank and select steps read
+   from the BWT and from the index.
+*/
+typedef struct _bwt_query_stats bwt_query_stats;
+struct _bwt_query_stats {
+   unsigned long long rank_calls;      // # rank (occ) lookups
+   unsigned long long select_calls;    // # select lookups
+   unsigned long long lf_steps;        // # steps back one text position
+   unsigned long long bwt_bytes;       // # BWT bytes scanned
+   unsigned long long idx_bytes;       // # index bytes read
+   unsigned long long blocks;          // # checkpoint blocks or rank
+                                       // directory rows read
+   double phase_seconds[BWT_NUM_PHASES];  // wall time of each BWT_PHASE_*
+   double seconds;                     // wall time from start to stop
+};
+
+/*
+   Called with every line bwt_search() finds, without its newline.
+   @return: 0 to go on, anything else to stop the search
+*/
+typedef int (*bwt_line_fn) (const char *line, unsigned int length, void *arg);
+
+/*
+   Called with every line bwt_search_approx() finds, without its newline,
+   and the fewest errors of a match on it.
+   @return: 0 to go on, anything else to stop the search
+*/
+typedef int (*bwt_approx_line_fn) (const char *line, unsigned int length, int errors, void *arg);
+
+
+/*********************************
+ **      FUNCTION PROTOTYPES    **
+ *********************************/
+
+void bwt_default_options (bwt_options *opts);
+int bwt_open (const char *bwt_path, const char *idx_path, const bwt_options *opts, bwt_index *ix);
+void bwt_close (bwt_index ix);
+int bwt_get_stats (bwt_index ix, bwt_stats *stats);
+const char *bwt_strerror (int err);
+
+/* QUERIES */
+int bwt_count (bwt_index ix, const char *pattern);
+int bwt_search (bwt_index ix, const char *pattern, int threads, int max_lines, bwt_line_fn fn, void *arg);
+int bwt_search_approx (bwt_index ix, const char *pattern, int max_errors, int mode, int threads, int max_lines, bwt_approx_line_fn fn, void *arg);
+int bwt_count_approx (bwt_index ix, const char *pattern, int max_errors, int mode);
+int bwt_locate (bwt_index ix, const char *pattern, unsigned int **offsets);
+int bwt_extract (bwt_index ix, unsigned int offset, int length, char *out);
+int bwt_unbwt (bwt_index ix, const char *output, int threads, size_t mem_budget);
+
+/* QUERY STATISTICS (of the calling thread only) */
+void bwt_start_stats (void);
+void bwt_stop_stats (bwt_query_stats *stats);
+void bwt_add_stats (bwt_query_stats *into, const bwt_query_stats *from);
+
+#endif
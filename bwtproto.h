@@ -0,0 +1,98 @@
+
+/*
+   Protocol of the resident query server (hearchtbw -S <socket>).
+
+   Every message is a frame: a 4 byte length in network byte order
+   followed by that many bytes.
+      request:    [command][pattern]
+      response:   [status][body]
+   The body is the text the command line prints for the same query.
+   A connection may carry any number of requests; the server answers
+   them in order and closes when the client does.
+*/
+
+#ifndef TRUE
+#define FALSE 0
+#define TRUE 1
+#endif
+
+#define PROTO_COUNT 'c'          // body is the number of matches
+#define PROTO_LINES 'l'          // body is the number and the matching lines
+#define PROTO_LOCATE 'o'         // body is the number and the text offsets
+#define PROTO_EXTRACT 'x'        // pattern is <offset>:<length>, body the text
+
+#define PROTO_OK 0
+#define PROTO_ERROR 1
+
+#define PROTO_MAX_FRAME (1 << 20)   // largest request the server accepts
+
+
+/*********************************
+ **      FUNCTION PROTOTYPES    **
+ *********************************/
+static int read_full (int fd, void *buf, size_t len);
+static int write_full (int fd, const void *buf, size_t len);
+static int send_frame (int fd, const void *head, size_t head_len, const void *body, size_t body_len);
+static int recv_frame (int fd, char **frame, uint32_t *len, uint32_t max);
+
+
+ /**********************************
+ **      FUNCTION DEFINITIONS     **
+ **********************************/
+
+// Read exactly len bytes. @return: TRUE, or FALSE on EOF / error
+static int read_full (int fd, void *buf, size_t len) {
+   char *p = buf;
+   while (len > 0) {
+      ssize_t got = read(fd,p,len);
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) return FALSE;
+      p += got;
+      len -= got;
+   }
+   return TRUE;
+}
+
+// Write exactly len bytes. @return: TRUE, or FALSE on error
+static int write_full (int fd, const void *buf, size_t len) {
+   const char *p = buf;
+   while (len > 0) {
+      ssize_t put = write(fd,p,len);
+      if (put < 0 && errno == EINTR) continue;
+      if (put <= 0) return FALSE;
+      p += put;
+      len -= put;
+   }
+   return TRUE;
+}
+
+/*
+   Send one frame made of head followed by body.
+*/
+static int send_frame (int fd, const void *head, size_t head_len, const void *body, size_t body_len) {
+   uint32_t len = htonl(head_len + body_len);
+   return write_full(fd,&len,sizeof(len))
+       && write_full(fd,head,head_len)
+       && write_full(fd,body,body_len);
+}
+
+/*
+   Receive one frame of at most max bytes into a new buffer, which is
+   NUL terminated for convenience. The caller frees *frame.
+   @return: TRUE, or FALSE on EOF, error or an oversized frame
+*/
+static int recv_frame (int fd, char **frame, uint32_t *len, uint32_t max) {
+   uint32_t net_len;
+   *frame = NULL;
+   if (!read_full(fd,&net_len,sizeof(net_len))) return FALSE;
+   *len = ntohl(net_len);
+   if (*len > max) return FALSE;
+   *frame = malloc(*len + 1);
+   if (!read_full(fd,*frame,*len)) {
+      free(*frame);
+      *frame = NULL;
+      return FALSE;
+   }
+   (*frame)[*len] = '\0';
+   return TRUE;
+}
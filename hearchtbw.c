@@ -21,7 +21,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "bwt.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "bwtlib.h"
+#include "bwtproto.h"
 
 
 /*********************************
@@ -31,12 +40,71 @@
 #define MAX_CHARS 256
 #define BWT_OFFSET 4
 
+// COMMAND LINE ARGUMENTS
+#define BWT_ARG 1
+#define INDEX_ARG 2
+#define QUERY_ARG 3
+#define UNBWT_ARG 4
+//TODO unbwt mode and search mode may have to be incremented by one/two
+// so we can use the out file for bwt
+#define UNBWT_MODE 5
+#define SEARCH_MODE 4
+#define BATCH_MODE 3
+
 
 
 /*/**********************************/
 /* **        TYPE DEFINES         ***/
 /* *********************************/
 
+/*
+   What a server thread needs to answer one client
+*/
+typedef struct _client_object *client;
+struct _client_object {
+   int fd;           // connected socket
+   bwt_index ix;     // the open index, shared read only
+} client_object;
+
+/*
+   Work queue of one batch worker: indices of the patterns it still has to
+   run. The owner takes from the front, idle workers steal from the back.
+*/
+typedef struct _work_queue *work_queue;
+struct _work_queue {
+   pthread_mutex_t lock;
+   int *items;
+   int head;         // next item the owner runs
+   int tail;         // one past the last item
+} work_queue_object;
+
+/*
+   State shared by the workers of a parallel batch
+*/
+typedef struct _batch_object *batch;
+struct _batch_object {
+   bwt_index ix;              // the open index, shared read only
+   char **patterns;
+   int num_patterns;
+   char **output;             // rendered answer of each pattern
+   size_t *output_len;
+   bwt_query_stats *stats;    // what each answer cost, with -v
+   int *done;                 // pattern i has been answered
+   pthread_mutex_t lock;      // guards done[]
+   pthread_cond_t answered;   // signalled when a pattern is done
+   work_queue queues;         // one per worker
+   int num_workers;
+} batch_object;
+
+/*
+   A batch worker: its queue and the batch it belongs to
+*/
+typedef struct _worker_object *worker;
+struct _worker_object {
+   batch b;
+   int id;
+} worker_object;
+
 
 
 
@@ -46,8 +114,27 @@
 
 /*static table read_last_char_pos (char *filename);*/
 static void handle_cmd_ln_args (int argc, char *argv[]);
-void unbwt(table st, FILE *bwt, FILE *idx, char *output);
-void write_unbwt(int size, FILE *unb);
+static int index_format_from_name (char *name);
+static void fail (int err);
+static void print_lines (bwt_index ix, char *query, FILE *out, int threads);
+static int print_line (const char *line, unsigned int length, void *arg);
+static void print_approx_lines (bwt_index ix, char *query, FILE *out, int threads);
+static int print_approx_line (const char *line, unsigned int length, int errors, void *arg);
+static void print_approx_count (bwt_index ix, char *query, FILE *out);
+static void print_count (bwt_index ix, char *query, FILE *out);
+static int print_locate (bwt_index ix, char *query, FILE *out);
+static int print_extract (bwt_index ix, char *range, FILE *out);
+static void print_stats (bwt_index ix, FILE *out);
+static void print_query_stats (char *query, int queries, bwt_query_stats *qs);
+static void print_json_string (FILE *out, const char *s);
+static void batch_search (bwt_index ix, char *batch_file);
+static void run_query (bwt_index ix, char *query, FILE *out, bwt_query_stats *qs);
+static void parallel_batch (bwt_index ix, char **patterns, int num_patterns, int num_workers);
+static void *run_batch_worker (void *arg);
+static int next_work_item (batch b, int id);
+static void serve (bwt_index ix, char *socket_path);
+static void *serve_client (void *arg);
+static int answer_request (bwt_index ix, char *request, uint32_t len, FILE *out);
 /*static void create_idx(char *idx_file_loc,unsigned int bwt_size);*/
 
 /*********************************
@@ -57,11 +144,23 @@ void write_unbwt(int size, FILE *unb);
 /*********************************
  **        GLOBAL VARIABLES     **
  *********************************/
-FILE *bwt;
-FILE *idx;
-int has_index;
 int search_mode;
-int idx_size;
+char *batch_file = NULL;            // patterns file for batch mode ("-" = stdin)
+char *socket_path = NULL;           // serve queries on this Unix socket
+char *extract_range = NULL;         // print this "<offset>:<length>" of the text
+int idx_format = BWT_FORMAT_CHECKPOINT;   // layout used when creating an index
+int locate_mode = FALSE;            // print text offsets instead of lines
+int count_mode = FALSE;             // print only the number of matches
+int max_lines = 0;                  // print at most this many lines (0 = all)
+unsigned int sa_rate = 0;           // suffix array sample rate (0 = none)
+unsigned int isa_rate = 0;          // inverse suffix array sample rate
+int num_threads = 1;                // worker threads (-j)
+size_t mem_budget = 0;              // unbwt memory cap (-m, 0 = the default)
+int stats_mode = FALSE;             // report what each query cost (-v)
+int max_errors = -1;                // match with up to this many errors (-k)
+int edit_mode = FALSE;              // -k errors may insert and delete (-e)
+char *format_names[] = {"checkpoint","rankdir","runlength","wavelet","interleaved"};   // by BWT_FORMAT_*
+char *phase_names[BWT_NUM_PHASES] = {"interval","backward","forward","dedup","output"};
 
 
 
@@ -72,53 +171,57 @@ int main (int argc, char *argv[])
 {
    
    handle_cmd_ln_args(argc,argv);
-   table st = new_symbol_table();
    /*
       If no index exists then must create one
       -> can we do it without an index file?
    */
-/*   table st = read_last_char_pos(argv[BWT_ARG]);*/
-   // next step is to create an index file (storing Occ/Rank) if one does not
-   // exist yet.
-   if (! has_index) {
-      create_idx (argv[INDEX_ARG],bwt);
-   }
-   idx = fopen(argv[INDEX_ARG],"r");
-   
-/*   fseek(idx,0,SEEK_END); // get length of index file*/
-/*   idx_size = ftell(idx);*/
-/*   rewind(idx);*/
-   
-   st->bwt_size = get_bwt_size(bwt);
-   st->idx_size = get_idx_size(idx);
-
-   c_table_from_idx(st,idx);
-   st->last = get_last_char_pos (bwt);
-      
-           
-       
+   // bwt_open() (re)builds the index if there is no current one, and
+   // adds the samples locate and extract need to it once
+   bwt_options opts;
+   bwt_default_options(&opts);
+   opts.format = idx_format;
+   opts.threads = (num_threads > 1) ? num_threads : 0;
+   opts.sa_rate = sa_rate;
+   opts.isa_rate = isa_rate;
+   if (locate_mode && sa_rate == 0) opts.sa_rate = BWT_SA_SAMPLE_RATE;
+   if (extract_range != NULL && isa_rate == 0) opts.isa_rate = BWT_ISA_SAMPLE_RATE;
+   bwt_index ix;
+   int err = bwt_open(argv[BWT_ARG],argv[INDEX_ARG],&opts,&ix);
+   if (err != BWT_OK) fail(err);
    
    // if search mode
-   if (search_mode) {
-      char *query = (argv[QUERY_ARG]);
-      backwards_search(query,st,bwt,idx);
+   if (socket_path != NULL) {
+      serve(ix,socket_path);
+   }
+   else if (batch_file != NULL) {
+      batch_search(ix,batch_file);
+   }
+   else if (search_mode) {
+      char *query = (extract_range != NULL) ? extract_range : argv[QUERY_ARG];
+      bwt_query_stats qs;
+      if (stats_mode) bwt_start_stats();
+      if (extract_range != NULL) {
+         if (!print_extract(ix,extract_range,stdout)) exit(-1);
+      }
+      else if (locate_mode) print_locate(ix,query,stdout);
+      else if (count_mode) print_count(ix,query,stdout);
+      else print_lines(ix,query,stdout,num_threads);
+      if (stats_mode) {
+         bwt_stop_stats(&qs);
+         print_query_stats(query,0,&qs);
+      }
    }
    else {
-      
-      unbwt(st,bwt,idx,argv[UNBWT_ARG]);
+      err = bwt_unbwt(ix,argv[UNBWT_ARG],num_threads,mem_budget);
+      if (err != BWT_OK) fail(err);
    }
    
    //TODO Else unbwt
-/*   */
-/*   // print c table*/
-/*      print_c_table(st->ctable);*/
-      print_stats(st);
+   // -x output is exactly the bytes asked for
+   print_stats(ix,(extract_range != NULL) ? stderr : stdout);
 
    // Free up memory
-   free(st->ctable);
-   free(st);
-   fclose(bwt);
-   fclose(idx);
+   bwt_close(ix);
       
    return 0;
 }
@@ -128,39 +231,616 @@ int main (int argc, char *argv[])
  **      FUNCTION DEFINITIONS     **
  **********************************/
 
-void unbwt(table st, FILE *bwt, FILE *idx, char *output) {
-   int i,j;
-   j = st->last;
-   int c;
-   
-   FILE *unb = fopen(output,"w+");
-   write_unbwt(st->bwt_size,unb);  //TODO check if I can don't have to do this.
-/*   int pointer;*/
-   for (i = st->bwt_size - 1; i >= 0; i--) {
-     fseek(bwt,BWT_OFFSET + j,SEEK_SET);
-     fseek(unb,i,SEEK_SET);
-     c = getc(bwt);
-     fputc(c,unb);
-
-/*     printf("%c",c);*/
-     j = st->ctable[c] + occ(c,j,bwt,idx);
-   }
-   fclose(unb);
+/*
+   Report a library error and give up.
+*/
+static void fail (int err) {
+   fprintf(stderr,"Error: %s\n",bwt_strerror(err));
+   exit(-1);
+}
+
+/*
+   Print the number of matches of query and every line holding one, or
+   the first max_lines of those lines with -n.
+*/
+static void print_lines (bwt_index ix, char *query, FILE *out, int threads) {
+   if (max_errors >= 0) {
+      print_approx_lines(ix,query,out,threads);
+      return;
+   }
+   // counting first is only |query| rank steps, and puts the count first
+   int matches = bwt_count(ix,query);
+   if (matches <= 0) {
+      fprintf(out,"No matches found\n");
+      return;
+   }
+   fprintf(out,"Number of matches = %d\n",matches);
+   bwt_search(ix,query,threads,max_lines,print_line,out);
+}
+
+static int print_line (const char *line, unsigned int length, void *arg) {
+   FILE *out = arg;
+   fwrite(line,1,length,out);
+   fputc('\n',out);
+   return 0;
+}
+
+/*
+   As print_lines() for the strings within max_errors of query, each 
+   line as "<errors>:<line>" with the fewest errors of a match on it,
+   fewest errors first.
+*/
+static void print_approx_lines (bwt_index ix, char *query, FILE *out, int threads) {
+   // the number of matches is only known once the lines are found
+   char *lines = NULL;
+   size_t length = 0;
+   FILE *held = open_memstream(&lines,&length);
+   int matches = bwt_search_approx(ix,query,max_errors,edit_mode ? BWT_EDITS : BWT_MISMATCHES,
+                                   threads,max_lines,print_approx_line,held);
+   fclose(held);
+   // a bound the query cannot take fails the run, a client only gets told
+   if (matches < 0 && socket_path == NULL) fail(matches);
+   if (matches < 0) fprintf(out,"Error: %s\n",bwt_strerror(matches));
+   else if (matches == 0) fprintf(out,"No matches found\n");
+   else {
+      fprintf(out,"Number of matches = %d\n",matches);
+      fwrite(lines,1,length,out);
+   }
+   free(lines);
+}
+
+static int print_approx_line (const char *line, unsigned int length, int errors, void *arg) {
+   FILE *out = arg;
+   fprintf(out,"%d:",errors);
+   fwrite(line,1,length,out);
+   fputc('\n',out);
+   return 0;
+}
+
+/*
+   Print only the number of occurrences of query.
+*/
+static void print_count (bwt_index ix, char *query, FILE *out) {
+   if (max_errors >= 0) {
+      print_approx_count(ix,query,out);
+      return;
+   }
+   int matches = bwt_count(ix,query);
+   if (matches <= 0) {
+      fprintf(out,"No matches found\n");
+   }
+   else {
+      fprintf(out,"Number of matches = %d\n",matches);
+   }
+}
+
+/*
+   Print only the number of text positions a string within max_errors
+   of query ends on.
+*/
+static void print_approx_count (bwt_index ix, char *query, FILE *out) {
+   int matches = bwt_count_approx(ix,query,max_errors,edit_mode ? BWT_EDITS : BWT_MISMATCHES);
+   // a bound the query cannot take fails the run, a client only gets told
+   if (matches < 0 && socket_path == NULL) fail(matches);
+   if (matches < 0) fprintf(out,"Error: %s\n",bwt_strerror(matches));
+   else if (matches == 0) fprintf(out,"No matches found\n");
+   else fprintf(out,"Number of matches = %d\n",matches);
+}
+
+/*
+   Print the text offset of every occurrence of query, in text order.
+   @return: FALSE if the index has no suffix array samples
+*/
+static int print_locate (bwt_index ix, char *query, FILE *out) {
+   unsigned int *offsets;
+   int matches = bwt_locate(ix,query,&offsets);
+   if (matches == BWT_ERR_NO_SAMPLES) {
+      fprintf(out,"Error: index has no suffix array samples (-s)\n");
+      return FALSE;
+   }
+   if (matches <= 0) {
+      fprintf(out,"No matches found\n");
+      return TRUE;
+   }
+   fprintf(out,"Number of matches = %d\n",matches);
+   int i;
+   for (i = 0; i < matches; i++) {
+      fprintf(out,"%u\n",offsets[i]);
+   }
+   free(offsets);
+   return TRUE;
+}
+
+/*
+   Print the text in range ("<offset>:<length>") as it is, without a 
+   trailing newline. A range running past the end of the text is cut.
+   @return: FALSE if range is malformed
+*/
+static int print_extract (bwt_index ix, char *range, FILE *out) {
+   unsigned int offset;
+   int length;
+   char tail;
+   bwt_stats stats;
+   if (sscanf(range,"%u:%d%c",&offset,&length,&tail) != 2 || length < 0) {
+      fprintf(out,"Error: range must be <offset>:<length>\n");
+      return FALSE;
+   }
+   bwt_get_stats(ix,&stats);
+   if (offset >= stats.bwt_size) return TRUE;
+   if ((unsigned int) length > stats.bwt_size - offset) length = stats.bwt_size - offset;
+   char *text = malloc(length + 1);
+   length = bwt_extract(ix,offset,length,text);
+   fwrite(text,1,length,out);
+   free(text);
+   return TRUE;
+}
+
+static void print_stats (bwt_index ix, FILE *out) {
+   bwt_stats stats;
+   bwt_get_stats(ix,&stats);
+   fprintf(out,"SIZE of BWT file is %d\n",stats.bwt_size);
+   fprintf(out,"SIZE of index file is %d\n",stats.idx_size);
+   if (stats_mode) {
+      fprintf(stderr,"{\"index\":{\"bwt_size\":%u,\"idx_size\":%u,\"format\":\"%s\","
+              "\"sa_rate\":%u,\"isa_rate\":%u}}\n",stats.bwt_size,stats.idx_size,
+              format_names[stats.format],
+              stats.sa_rate,stats.isa_rate);
+   }
+}
+
+/*
+   Print what a query cost to stderr as one line of JSON:
+      {"query":"...","seconds":...,"rank_calls":...,...,"phases":{...}}
+   Totals of a batch have "queries":<queries> in place of the query.
+*/
+static void print_query_stats (char *query, int queries, bwt_query_stats *qs) {
+   int p;
+   // server threads print at once, keep each line whole
+   flockfile(stderr);
+   if (query != NULL) {
+      fprintf(stderr,"{\"query\":");
+      print_json_string(stderr,query);
+   }
+   else {
+      fprintf(stderr,"{\"queries\":%d",queries);
+   }
+   fprintf(stderr,",\"seconds\":%.6f,\"rank_calls\":%llu,\"select_calls\":%llu,"
+           "\"lf_steps\":%llu,\"bwt_bytes\":%llu,\"idx_bytes\":%llu,\"blocks\":%llu,"
+           "\"phases\":{",qs->seconds,qs->rank_calls,qs->select_calls,qs->lf_steps,
+           qs->bwt_bytes,qs->idx_bytes,qs->blocks);
+   for (p = 0; p < BWT_NUM_PHASES; p++) {
+      fprintf(stderr,"%s\"%s\":%.6f",(p > 0) ? "," : "",phase_names[p],qs->phase_seconds[p]);
+   }
+   fprintf(stderr,"}}\n");
+   funlockfile(stderr);
+}
+
+static void print_json_string (FILE *out, const char *s) {
+   fputc('"',out);
+   for (; *s != '\0'; s++) {
+      unsigned char c = *s;
+      if (c == '"' || c == '\\') fprintf(out,"\\%c",c);
+      else if (c < 0x20) fprintf(out,"\\u%04x",c);
+      else fputc(c,out);
+   }
+   fputc('"',out);
+}
+
+/*
+   Run every pattern in batch_file (one per line, "-" for stdin) against
+   the loaded index. Each pattern's output starts with "Query = <pattern>"
+   and ends with an empty line; result lines are never empty since they
+   contain the pattern. With more than one thread the patterns are read
+   up front and answered by a pool, but still written in input order.
+*/
+static void batch_search (bwt_index ix, char *batch_file) {
+   FILE *patterns = stdin;
+   if (strcmp(batch_file,"-") != 0) patterns = fopen(batch_file,"r");
+   if (patterns == NULL) exit(-1);
+   char *line = NULL;
+   size_t cap = 0;
+   ssize_t len;
+   char **all = NULL;
+   int num_patterns = 0;
+   int all_cap = 0;
+   int num_run = 0;
+   bwt_query_stats totals;
+   memset(&totals,0,sizeof(totals));
+   while ((len = getline(&line,&cap,patterns)) != -1) {
+      if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+      if (len == 0) continue;
+      if (num_threads <= 1) {
+         bwt_query_stats qs;
+         run_query(ix,line,stdout,stats_mode ? &qs : NULL);
+         if (stats_mode) {
+            print_query_stats(line,0,&qs);
+            bwt_add_stats(&totals,&qs);
+            num_run++;
+         }
+         continue;
+      }
+      if (num_patterns == all_cap) {
+         all_cap = (all_cap == 0) ? 64 : all_cap * 2;
+         all = realloc(all,sizeof(char *) * all_cap);
+      }
+      all[num_patterns++] = strdup(line);
+   }
+   free(line);
+   if (patterns != stdin) fclose(patterns);
+
+   if (num_patterns > 0) parallel_batch(ix,all,num_patterns,num_threads);
+   if (stats_mode && num_threads <= 1) print_query_stats(NULL,num_run,&totals);
+   int i;
+   for (i = 0; i < num_patterns; i++) free(all[i]);
+   free(all);
 }
 
-void write_unbwt(int size, FILE *unb) {
-/*   FILE *unb = fopen("unbwt.unbwt","w+");*/
-   unsigned int nothing = 'a';
+/*
+   Answer one batch pattern, framed by its "Query = " line and an empty line.
+   @params: *qs gets what the answer cost, unless it is NULL
+*/
+static void run_query (bwt_index ix, char *query, FILE *out, bwt_query_stats *qs) {
+   fprintf(out,"Query = %s\n",query);
+   if (qs != NULL) bwt_start_stats();
+   if (locate_mode) print_locate(ix,query,out);
+   else if (count_mode) print_count(ix,query,out);
+   // with -j the batch runs one pattern per thread already
+   else print_lines(ix,query,out,1);
+   if (qs != NULL) bwt_stop_stats(qs);
+   fprintf(out,"\n");
+}
+
+/*
+   Answer the patterns on num_workers threads. Pattern i starts in the
+   queue of worker i % num_workers, so the workers move through the
+   input roughly together and the main thread can write each answer as
+   soon as the ones before it are out.
+*/
+static void parallel_batch (bwt_index ix, char **patterns, int num_patterns, int num_workers) {
+   struct _batch_object b;
    int i;
-   for (i = 0; i < size; i += 1) {
-      fputc(nothing,unb);
+   b.ix = ix;
+   b.patterns = patterns;
+   b.num_patterns = num_patterns;
+   b.output = calloc(num_patterns,sizeof(char *));
+   b.output_len = calloc(num_patterns,sizeof(size_t));
+   b.stats = stats_mode ? calloc(num_patterns,sizeof(bwt_query_stats)) : NULL;
+   b.done = calloc(num_patterns,sizeof(int));
+   b.num_workers = num_workers;
+   b.queues = malloc(sizeof(work_queue_object) * num_workers);
+   pthread_mutex_init(&b.lock,NULL);
+   pthread_cond_init(&b.answered,NULL);
+   for (i = 0; i < num_workers; i++) {
+      pthread_mutex_init(&b.queues[i].lock,NULL);
+      b.queues[i].items = malloc(sizeof(int) * (num_patterns / num_workers + 1));
+      b.queues[i].head = 0;
+      b.queues[i].tail = 0;
+   }
+   for (i = 0; i < num_patterns; i++) {
+      work_queue q = &b.queues[i % num_workers];
+      q->items[q->tail++] = i;
+   }
+
+   pthread_t *threads = malloc(sizeof(pthread_t) * num_workers);
+   worker workers = malloc(sizeof(worker_object) * num_workers);
+   for (i = 0; i < num_workers; i++) {
+      workers[i].b = &b;
+      workers[i].id = i;
+      if (pthread_create(&threads[i],NULL,run_batch_worker,&workers[i]) != 0) exit(-1);
+   }
+
+   // write the answers in input order as they come in
+   bwt_query_stats totals;
+   memset(&totals,0,sizeof(totals));
+   for (i = 0; i < num_patterns; i++) {
+      pthread_mutex_lock(&b.lock);
+      while (!b.done[i]) pthread_cond_wait(&b.answered,&b.lock);
+      pthread_mutex_unlock(&b.lock);
+      fwrite(b.output[i],1,b.output_len[i],stdout);
+      free(b.output[i]);
+      if (b.stats != NULL) {
+         print_query_stats(patterns[i],0,&b.stats[i]);
+         bwt_add_stats(&totals,&b.stats[i]);
+      }
+   }
+   if (b.stats != NULL) print_query_stats(NULL,num_patterns,&totals);
+
+   for (i = 0; i < num_workers; i++) {
+      pthread_join(threads[i],NULL);
    }
-/*   fclose(unb);*/
+   for (i = 0; i < num_workers; i++) {
+      pthread_mutex_destroy(&b.queues[i].lock);
+      free(b.queues[i].items);
+   }
+   pthread_mutex_destroy(&b.lock);
+   pthread_cond_destroy(&b.answered);
+   free(threads);
+   free(workers);
+   free(b.queues);
+   free(b.output);
+   free(b.output_len);
+   free(b.stats);
+   free(b.done);
 }
 
+static void *run_batch_worker (void *arg) {
+   worker w = arg;
+   batch b = w->b;
+   int i;
+   while ((i = next_work_item(b,w->id)) != -1) {
+      // each answer is rendered into its own buffer
+      FILE *out = open_memstream(&b->output[i],&b->output_len[i]);
+      run_query(b->ix,b->patterns[i],out,(b->stats != NULL) ? &b->stats[i] : NULL);
+      fclose(out);
+      pthread_mutex_lock(&b->lock);
+      b->done[i] = TRUE;
+      pthread_cond_broadcast(&b->answered);
+      pthread_mutex_unlock(&b->lock);
+   }
+   return NULL;
+}
+
+/*
+   Next pattern for worker id: the front of its own queue, or else the
+   back of the fullest other queue.
+   @return: the pattern index, or -1 once every queue is empty
+*/
+static int next_work_item (batch b, int id) {
+   work_queue own = &b->queues[id];
+   int item = -1;
+   pthread_mutex_lock(&own->lock);
+   if (own->head < own->tail) item = own->items[own->head++];
+   pthread_mutex_unlock(&own->lock);
+   while (item == -1) {
+      int victim = -1;
+      int most = 0;
+      int i;
+      for (i = 0; i < b->num_workers; i++) {
+         if (i == id) continue;
+         pthread_mutex_lock(&b->queues[i].lock);
+         int left = b->queues[i].tail - b->queues[i].head;
+         pthread_mutex_unlock(&b->queues[i].lock);
+         if (left > most) {
+            most = left;
+            victim = i;
+         }
+      }
+      if (victim == -1) break;
+      // the victim may have emptied meanwhile, then look again
+      work_queue q = &b->queues[victim];
+      pthread_mutex_lock(&q->lock);
+      if (q->head < q->tail) item = q->items[--q->tail];
+      pthread_mutex_unlock(&q->lock);
+   }
+   return item;
+}
+
+/*
+   Daemon mode: keep the index loaded and answer queries framed as in
+   bwtproto.h on a Unix socket, one thread per connected client.
+   Runs until the process is killed.
+*/
+static void serve (bwt_index ix, char *socket_path) {
+   struct sockaddr_un addr;
+   int listener = socket(AF_UNIX,SOCK_STREAM,0);
+   if (listener == -1) exit(-1);
+   memset(&addr,0,sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(socket_path) >= sizeof(addr.sun_path)) exit(-1);
+   strcpy(addr.sun_path,socket_path);
+   // a socket left by an earlier server would make bind fail
+   unlink(socket_path);
+   if (bind(listener,(struct sockaddr *) &addr,sizeof(addr)) == -1) exit(-1);
+   if (listen(listener,SOMAXCONN) == -1) exit(-1);
+   // a client hanging up mid answer must not kill the server
+   signal(SIGPIPE,SIG_IGN);
+
+   while (TRUE) {
+      int fd = accept(listener,NULL,NULL);
+      if (fd == -1) {
+         if (errno == EINTR || errno == ECONNABORTED) continue;
+         exit(-1);
+      }
+      client cl = malloc(sizeof(client_object));
+      cl->fd = fd;
+      cl->ix = ix;
+      pthread_t thread;
+      if (pthread_create(&thread,NULL,serve_client,cl) != 0) {
+         close(fd);
+         free(cl);
+         continue;
+      }
+      pthread_detach(thread);
+   }
+}
+
+/*
+   Answer the requests of one client until it hangs up.
+*/
+static void *serve_client (void *arg) {
+   client cl = arg;
+   char *request;
+   uint32_t len;
+   while (recv_frame(cl->fd,&request,&len,PROTO_MAX_FRAME)) {
+      char *body = NULL;
+      size_t body_len = 0;
+      FILE *out = open_memstream(&body,&body_len);
+      bwt_query_stats qs;
+      if (stats_mode) bwt_start_stats();
+      unsigned char status = answer_request(cl->ix,request,len,out);
+      if (stats_mode) {
+         bwt_stop_stats(&qs);
+         print_query_stats((len > 0) ? request + 1 : request,0,&qs);
+      }
+      fclose(out);
+      int sent = send_frame(cl->fd,&status,1,body,body_len);
+      free(body);
+      free(request);
+      if (!sent) break;
+   }
+   close(cl->fd);
+   free(cl);
+   return NULL;
+}
 
+/*
+   Run one request ([command][pattern]) and print its answer to out.
+   @return: PROTO_OK or PROTO_ERROR
+*/
+static int answer_request (bwt_index ix, char *request, uint32_t len, FILE *out) {
+   if (len < 2 || strlen(request + 1) != len - 1) {
+      fprintf(out,"Error: empty pattern or NUL in pattern\n");
+      return PROTO_ERROR;
+   }
+   char *query = request + 1;
+   bwt_stats stats;
+   switch (request[0]) {
+      case PROTO_COUNT:
+         print_count(ix,query,out);
+         break;
+      case PROTO_LINES:
+         print_lines(ix,query,out,num_threads);
+         break;
+      case PROTO_LOCATE:
+         if (!print_locate(ix,query,out)) return PROTO_ERROR;
+         break;
+      case PROTO_EXTRACT:
+         bwt_get_stats(ix,&stats);
+         if (stats.isa_rate == 0) {
+            fprintf(out,"Error: index has no inverse suffix array samples (-i)\n");
+            return PROTO_ERROR;
+         }
+         if (!print_extract(ix,query,out)) return PROTO_ERROR;
+         break;
+      default:
+         fprintf(out,"Error: unknown command '%c'\n",request[0]);
+         return PROTO_ERROR;
+   }
+   return PROTO_OK;
+}
+
+/*
+   Options come before the BWT file:
+      -f <checkpoint|rankdir|runlength|wavelet|interleaved>
+                                 layout of the index if it has to be created
+      -s <rate>                  add suffix array samples every <rate> 
+                                 text positions to the index
+      -l                         locate: print the text offset of each match
+      -c                         count: print only the number of matches
+      -n <lines>                 print at most the first <lines> lines, 
+                                 only those are rebuilt
+      -b <file>                  batch: search every line of <file> ("-" 
+                                 for stdin), the query argument is dropped
+      -S <socket>                serve count, line, locate and extract
+                                 queries on a Unix socket (see bwtproto.h),
+                                 the query argument is dropped
+      -i <rate>                  add inverse suffix array samples every
+                                 <rate> text positions to the index
+      -x <offset>:<length>       extract: print that much of the text from
+                                 <offset> (adds -i samples at 
+                                 BWT_ISA_SAMPLE_RATE if there are none), the
+                                 query argument is dropped; stdout holds
+                                 only those bytes, the sizes go to stderr
+      -j <threads>               run batch patterns on <threads> threads,
+                                 rebuild the lines of one query on them,
+                                 or unbwt on them (needs -i samples)
+      -m <MB>                    memory unbwt may use for its output buffer
+                                 (default UNBWT_MEM_BUDGET in bwt.h)
+      -v                         print what each query cost (rank and 
+                                 select calls, LF steps, bytes read, time
+                                 per phase) to stderr as a line of JSON,
+                                 and the totals of a batch
+      -k <errors>                approximate: also match strings with up
+                                 to <errors> substituted characters (at 
+                                 most BWT_MAX_ERRORS and below half the
+                                 query length), print each line as 
+                                 "<errors>:<line>" with its fewest errors,
+                                 fewest first (not with -l)
+      -e                         with -k, inserted and deleted characters
+                                 are errors too (edit distance)
+   They are removed from argv so the other arguments keep their slots.
+*/
 static void handle_cmd_ln_args (int argc, char *argv[]) {
-   if (argc == UNBWT_MODE) {
+   int opts = 1;
+   while (opts < argc && argv[opts][0] == '-') {
+      if (strcmp(argv[opts],"-f") == 0 && opts + 1 < argc) {
+         idx_format = index_format_from_name(argv[opts + 1]);
+         if (idx_format < 0) exit(-1);
+         opts += 2;
+      }
+      else if (strcmp(argv[opts],"-s") == 0 && opts + 1 < argc) {
+         sa_rate = atoi(argv[opts + 1]);
+         if (sa_rate == 0) exit(-1);
+         opts += 2;
+      }
+      else if (strcmp(argv[opts],"-b") == 0 && opts + 1 < argc) {
+         batch_file = argv[opts + 1];
+         opts += 2;
+      }
+      else if (strcmp(argv[opts],"-S") == 0 && opts + 1 < argc) {
+         socket_path = argv[opts + 1];
+         opts += 2;
+      }
+      else if (strcmp(argv[opts],"-i") == 0 && opts + 1 < argc) {
+         isa_rate = atoi(argv[opts + 1]);
+         if (isa_rate == 0) exit(-1);
+         opts += 2;
+      }
+      else if (strcmp(argv[opts],"-j") == 0 && opts + 1 < argc) {
+         num_threads = atoi(argv[opts + 1]);
+         if (num_threads < 1) exit(-1);
+         opts += 2;
+      }
+      else if (strcmp(argv[opts],"-m") == 0 && opts + 1 < argc) {
+         mem_budget = (size_t) atoi(argv[opts + 1]) << 20;
+         if (mem_budget == 0) exit(-1);
+         opts += 2;
+      }
+      else if (strcmp(argv[opts],"-x") == 0 && opts + 1 < argc) {
+         extract_range = argv[opts + 1];
+         opts += 2;
+      }
+      else if (strcmp(argv[opts],"-l") == 0) {
+         locate_mode = TRUE;
+         opts++;
+      }
+      else if (strcmp(argv[opts],"-c") == 0) {
+         count_mode = TRUE;
+         opts++;
+      }
+      else if (strcmp(argv[opts],"-v") == 0) {
+         stats_mode = TRUE;
+         opts++;
+      }
+      else if (strcmp(argv[opts],"-k") == 0 && opts + 1 < argc) {
+         char *end;
+         max_errors = strtol(argv[opts + 1],&end,10);
+         if (*end != '\0' || max_errors < 0 || max_errors > BWT_MAX_ERRORS) exit(-1);
+         opts += 2;
+      }
+      else if (strcmp(argv[opts],"-e") == 0) {
+         edit_mode = TRUE;
+         opts++;
+      }
+      else if (strcmp(argv[opts],"-n") == 0 && opts + 1 < argc) {
+         max_lines = atoi(argv[opts + 1]);
+         if (max_lines < 1) exit(-1);
+         opts += 2;
+      }
+      else {
+         exit(-1);
+      }
+   }
+   if (edit_mode && max_errors < 0) exit(-1);
+   if (locate_mode && max_errors >= 0) exit(-1);
+   memmove(&argv[1],&argv[opts],sizeof(char *) * (argc - opts + 1));
+   argc -= opts - 1;
+
+   if (batch_file != NULL || socket_path != NULL || extract_range != NULL) {
+      if (argc != BATCH_MODE) exit(-1);
+      search_mode = TRUE;
+   }
+   else if (argc == UNBWT_MODE) {
       search_mode = FALSE;
    }
    else if (argc == SEARCH_MODE) {
@@ -169,18 +849,22 @@ static void handle_cmd_ln_args (int argc, char *argv[]) {
    else {
       exit(-1);
    }
-   bwt = fopen(argv[BWT_ARG],"r");
-   if (bwt == NULL) exit(-1);
-   idx = fopen(argv[INDEX_ARG],"r");
-   if (idx == NULL) {
-      has_index = FALSE;
-   }
-   else {
-      has_index = TRUE;
-   }
    
 } 
 
+/*
+   Map an index format name from the command line to its BWT_FORMAT_* value.
+   @return: the format or -1 if the name is unknown
+*/
+static int index_format_from_name (char *name) {
+   if (strcmp(name,"checkpoint") == 0) return BWT_FORMAT_CHECKPOINT;
+   if (strcmp(name,"rankdir") == 0) return BWT_FORMAT_RANKDIR;
+   if (strcmp(name,"runlength") == 0) return BWT_FORMAT_RUNLENGTH;
+   if (strcmp(name,"wavelet") == 0) return BWT_FORMAT_WAVELET;
+   if (strcmp(name,"interleaved") == 0) return BWT_FORMAT_INTERLEAVED;
+   return -1;
+}
+
 
 /*static table read_last_char_pos (char *filename) {*/
 /*   printf("START TO READ FILE\n");*/